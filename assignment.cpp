@@ -1,8 +1,302 @@
 
 #include <bits/stdc++.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
+// =============================================================================
+// INSTRUMENTATION
+// =============================================================================
+
+// Heap allocations made through operator new are counted per thread, so
+// phases can report how many allocations they performed. Counting is off
+// until a compiler is asked for stats; until then the hook costs one
+// relaxed load per allocation.
+struct AllocationCounters {
+    uint64_t count;
+    uint64_t bytes;
+};
+
+thread_local AllocationCounters allocationCounters = {0, 0};
+atomic<bool> allocationCounting{false};
+
+// Once on, counting stays on for the rest of the process.
+void enableAllocationCounting() {
+    allocationCounting.store(true, memory_order_relaxed);
+}
+
+inline void countAllocation(size_t size) {
+    if (!allocationCounting.load(memory_order_relaxed)) return;
+    allocationCounters.count++;
+    allocationCounters.bytes += size;
+}
+
+// Every form of new is replaced, so every form of delete can use free().
+// GCC sees the pairing of new with free() once delete is inlined and warns
+// about it, so that warning is off for these definitions.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(size_t size) {
+    countAllocation(size);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+    countAllocation(size);
+    void* p = nullptr;
+    if (posix_memalign(&p, max((size_t)alignment, sizeof(void*)), size ? size : 1) == 0) return p;
+    throw bad_alloc();
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    countAllocation(size);
+    return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    countAllocation(size);
+    void* p = nullptr;
+    return posix_memalign(&p, max((size_t)alignment, sizeof(void*)), size ? size : 1) == 0 ? p : nullptr;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new[](size_t size, align_val_t alignment) { return operator new(size, alignment); }
+void* operator new[](size_t size, const nothrow_t& tag) noexcept { return operator new(size, tag); }
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t& tag) noexcept {
+    return operator new(size, alignment, tag);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { free(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { free(p); }
+void operator delete(void* p, align_val_t, const nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { free(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept { free(p); }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+enum class Phase {
+    LEX,
+    PARSE,
+    OPTIMIZE,
+    CODEGEN,
+    ALLOCATE,
+    EMIT,
+    COUNT
+};
+
+const char* phaseName(Phase phase) {
+    switch (phase) {
+        case Phase::LEX:      return "lex";
+        case Phase::PARSE:    return "parse";
+        case Phase::OPTIMIZE: return "optimize";
+        case Phase::CODEGEN:  return "codegen";
+        case Phase::ALLOCATE: return "allocate";
+        case Phase::EMIT:     return "emit";
+        default:              return "unknown";
+    }
+}
+
+struct PhaseStats {
+    double seconds = 0;
+    uint64_t allocations = 0;
+    uint64_t allocatedBytes = 0;
+    
+    void subtract(const PhaseStats& other) {
+        seconds -= other.seconds;
+        allocations -= other.allocations;
+        allocatedBytes -= other.allocatedBytes;
+    }
+};
+
+// Accumulates wall time and allocations into a PhaseStats for its lifetime.
+class PhaseTimer {
+private:
+    PhaseStats& stats;
+    chrono::steady_clock::time_point start;
+    AllocationCounters startAllocations;
+    
+public:
+    PhaseTimer(PhaseStats& target) 
+        : stats(target), start(chrono::steady_clock::now()), startAllocations(allocationCounters) {}
+    
+    ~PhaseTimer() {
+        stats.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        stats.allocations += allocationCounters.count - startAllocations.count;
+        stats.allocatedBytes += allocationCounters.bytes - startAllocations.bytes;
+    }
+};
+
+struct CompileStats {
+    PhaseStats phases[(size_t)Phase::COUNT];
+    uint64_t sourceBytes = 0;
+    uint64_t tokens = 0;
+    uint64_t astNodes = 0;
+    uint64_t statements = 0;
+    uint64_t instructionsGenerated = 0;
+    uint64_t instructionsEmitted = 0;
+    uint64_t memoryBytes = 0;   // Peak data footprint
+    uint64_t codeBytes = 0;     // Encoded program size
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t cacheEvictions = 0;
+    
+    PhaseStats& operator[](Phase phase) { return phases[(size_t)phase]; }
+    
+    void accumulate(const CompileStats& other) {
+        for (size_t i = 0; i < (size_t)Phase::COUNT; i++) {
+            phases[i].seconds += other.phases[i].seconds;
+            phases[i].allocations += other.phases[i].allocations;
+            phases[i].allocatedBytes += other.phases[i].allocatedBytes;
+        }
+        sourceBytes += other.sourceBytes;
+        tokens += other.tokens;
+        astNodes += other.astNodes;
+        statements += other.statements;
+        instructionsGenerated += other.instructionsGenerated;
+        instructionsEmitted += other.instructionsEmitted;
+        memoryBytes = max(memoryBytes, other.memoryBytes);
+        codeBytes += other.codeBytes;
+        cacheHits += other.cacheHits;
+        cacheMisses += other.cacheMisses;
+        cacheEvictions += other.cacheEvictions;
+    }
+    
+    void writeJson(ostream& out) const {
+        double total = 0;
+        out << "{\"source_bytes\":" << sourceBytes
+            << ",\"tokens\":" << tokens
+            << ",\"ast_nodes\":" << astNodes
+            << ",\"statements\":" << statements
+            << ",\"instructions_generated\":" << instructionsGenerated
+            << ",\"instructions_emitted\":" << instructionsEmitted
+            << ",\"memory_bytes\":" << memoryBytes
+            << ",\"code_bytes\":" << codeBytes
+            << ",\"cache\":{\"hits\":" << cacheHits
+            << ",\"misses\":" << cacheMisses
+            << ",\"evictions\":" << cacheEvictions << "}"
+            << ",\"phases\":{";
+        for (size_t i = 0; i < (size_t)Phase::COUNT; i++) {
+            const PhaseStats& phase = phases[i];
+            total += phase.seconds;
+            out << (i ? "," : "") << "\"" << phaseName((Phase)i) << "\":{"
+                << "\"seconds\":" << phase.seconds
+                << ",\"allocations\":" << phase.allocations
+                << ",\"allocated_bytes\":" << phase.allocatedBytes << "}";
+        }
+        out << "},\"total_seconds\":" << total << "}" << endl;
+    }
+    
+    void writeText(ostream& out) const {
+        out << "Source bytes: " << sourceBytes << ", tokens: " << tokens 
+            << ", AST nodes: " << astNodes << ", statements: " << statements << endl;
+        out << "Instructions generated: " << instructionsGenerated 
+            << ", emitted: " << instructionsEmitted << endl;
+        out << "Code: " << codeBytes << " bytes, memory: " << memoryBytes << " bytes" << endl;
+        if (cacheHits + cacheMisses > 0) {
+            out << "Cache hits: " << cacheHits << ", misses: " << cacheMisses 
+                << ", evictions: " << cacheEvictions << endl;
+        }
+        for (size_t i = 0; i < (size_t)Phase::COUNT; i++) {
+            const PhaseStats& phase = phases[i];
+            out << left << setw(10) << phaseName((Phase)i) << right << fixed << setprecision(6) 
+                << phase.seconds << " s  " << phase.allocations << " allocations, " 
+                << phase.allocatedBytes << " bytes" << defaultfloat << endl;
+        }
+    }
+};
+
+// =============================================================================
+// DIAGNOSTIC OUTPUT
+// =============================================================================
+
+// Buffers human-readable progress output and writes it in large chunks
+// without per-line flushes. A sink without a stream discards everything, so
+// quiet runs do no diagnostic I/O at all.
+class DiagnosticSink {
+private:
+    static const size_t FLUSH_THRESHOLD = 1 << 16;
+    
+    ostream* out;
+    string buffer;
+    
+public:
+    DiagnosticSink(ostream* stream = nullptr) : out(stream) {}
+    ~DiagnosticSink() { flush(); }
+    
+    DiagnosticSink(const DiagnosticSink&) = delete;
+    DiagnosticSink& operator=(const DiagnosticSink&) = delete;
+    
+    void setStream(ostream* stream) {
+        flush();
+        out = stream;
+    }
+    
+    bool enabled() const { return out != nullptr; }
+    
+    DiagnosticSink& operator<<(string_view text) {
+        if (!out) return *this;
+        if (text.size() >= FLUSH_THRESHOLD) {
+            // Large blocks (listings) skip the buffer copy
+            flush();
+            out->write(text.data(), text.size());
+            out->flush();
+        } else {
+            buffer.append(text);
+            if (buffer.size() >= FLUSH_THRESHOLD) flush();
+        }
+        return *this;
+    }
+    
+    DiagnosticSink& operator<<(const char* text) { return *this << string_view(text); }
+    DiagnosticSink& operator<<(const string& text) { return *this << string_view(text); }
+    
+    DiagnosticSink& operator<<(char c) {
+        if (out) buffer.push_back(c);
+        return *this;
+    }
+    
+    template <typename T, typename = enable_if_t<is_integral_v<T> && !is_same_v<T, char> && !is_same_v<T, bool>>>
+    DiagnosticSink& operator<<(T value) {
+        if (out) {
+            char digits[24];
+            auto result = to_chars(digits, digits + sizeof(digits), value);
+            buffer.append(digits, result.ptr - digits);
+        }
+        return *this;
+    }
+    
+    void flush() {
+        if (out && !buffer.empty()) {
+            out->write(buffer.data(), buffer.size());
+            out->flush();
+            buffer.clear();
+        }
+    }
+};
+
 // =============================================================================
 // TOKEN DEFINITIONS
 // =============================================================================
@@ -25,618 +319,5944 @@ enum class TokenType {
     TOKEN_UNKNOWN
 };
 
+// Token text is a view into the source buffer, which must outlive the token.
 struct Token {
     TokenType type;
-    string text;
+    string_view text;
+    int value;   // Parsed value of TOKEN_NUMBER, symbol ID of TOKEN_IDENTIFIER
     int line;
     int column;
     
-    Token(TokenType t = TokenType::TOKEN_UNKNOWN, const string& txt = "", int ln = 1, int col = 1) 
-        : type(t), text(txt), line(ln), column(col) {}
+    Token(TokenType t = TokenType::TOKEN_UNKNOWN, string_view txt = {}, int ln = 1, int col = 1, int val = 0) 
+        : type(t), text(txt), value(val), line(ln), column(col) {}
 };
 
-// =============================================================================
-// LEXER CLASS
-// =============================================================================
+const char* tokenTypeName(TokenType type) {
+    switch (type) {
+        case TokenType::TOKEN_INT:        return "'int'";
+        case TokenType::TOKEN_IDENTIFIER: return "identifier";
+        case TokenType::TOKEN_NUMBER:     return "number";
+        case TokenType::TOKEN_ASSIGN:     return "'='";
+        case TokenType::TOKEN_PLUS:       return "'+'";
+        case TokenType::TOKEN_MINUS:      return "'-'";
+        case TokenType::TOKEN_IF:         return "'if'";
+        case TokenType::TOKEN_EQUAL:      return "'=='";
+        case TokenType::TOKEN_LPAREN:     return "'('";
+        case TokenType::TOKEN_RPAREN:     return "')'";
+        case TokenType::TOKEN_LBRACE:     return "'{'";
+        case TokenType::TOKEN_RBRACE:     return "'}'";
+        case TokenType::TOKEN_SEMICOLON:  return "';'";
+        case TokenType::TOKEN_EOF:        return "end of input";
+        case TokenType::TOKEN_UNKNOWN:    return "unknown character";
+    }
+    return "token";
+}
 
-class Lexer {
-private:
-    string source;
-    size_t position;
+// A syntax error found while lexing or parsing, at the position of the
+// offending token.
+struct Diagnostic {
+    int line;
+    int column;
+    string message;
+};
+
+// Thrown inside the parser and turned into a Diagnostic by its recovery.
+struct SyntaxError : runtime_error {
     int line;
     int column;
     
-    char currentChar() {
-        if (position >= source.length()) return '\0';
-        return source[position];
-    }
-    
-    char peekChar() {
-        if (position + 1 >= source.length()) return '\0';
-        return source[position + 1];
-    }
+    SyntaxError(const Token& at, const string& message) 
+        : runtime_error(message), line(at.line), column(at.column) {}
+};
+
+// =============================================================================
+// SOURCE BUFFER
+// =============================================================================
+
+// Owns the bytes of a source file. Files are memory-mapped when possible so
+// large inputs are never copied; anything mmap cannot handle (pipes, empty
+// files, mapping failures) falls back to reading into an owned string.
+// The text is always followed by a '\0' byte for the lexer: a mapping is
+// zero-filled past EOF to the end of its last page, so only files that are
+// an exact multiple of the page size are read instead.
+class SourceBuffer {
+private:
+    void* mapped;
+    size_t mappedLength;
+    string owned;
+    string_view contents;
     
-    void advance() {
-        if (position < source.length() && source[position] == '\n') {
-            line++;
-            column = 1;
-        } else {
-            column++;
+    void release() {
+        if (mapped) {
+            munmap(mapped, mappedLength);
+            mapped = nullptr;
+            mappedLength = 0;
         }
-        position++;
+        owned.clear();
+        contents = owned;
     }
     
-    void skipWhitespace() {
-        while (isspace(currentChar())) {
-            advance();
-        }
-    }
+public:
+    SourceBuffer() : mapped(nullptr), mappedLength(0), contents(owned) {}
+    ~SourceBuffer() { release(); }
     
-    void skipComments() {
-        if (currentChar() == '/' && peekChar() == '/') {
-            while (currentChar() != '\n' && currentChar() != '\0') {
-                advance();
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+    
+    bool loadFile(const string& filename) {
+        release();
+        
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        
+        struct stat info;
+        static const long pageSize = sysconf(_SC_PAGESIZE);
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && 
+            info.st_size % pageSize != 0) {
+            void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+                mapped = data;
+                mappedLength = (size_t)info.st_size;
+                contents = string_view((const char*)data, mappedLength);
+                close(fd);
+                return true;
             }
         }
-    }
-    
-    string readIdentifier() {
-        string result;
-        while (isalnum(currentChar()) || currentChar() == '_') {
-            result += currentChar();
-            advance();
+        
+        char chunk[65536];
+        ssize_t count;
+        while ((count = read(fd, chunk, sizeof(chunk))) > 0) {
+            owned.append(chunk, (size_t)count);
         }
-        return result;
+        close(fd);
+        if (count < 0) {
+            owned.clear();
+            return false;
+        }
+        contents = owned;
+        return true;
     }
     
-    string readNumber() {
-        string result;
-        while (isdigit(currentChar())) {
-            result += currentChar();
-            advance();
-        }
-        return result;
+    void assign(const string& text) {
+        release();
+        owned = text;
+        contents = owned;
     }
     
-public:
-    Lexer(const string& src) : source(src), position(0), line(1), column(1) {}
+    bool isMapped() const { return mapped != nullptr; }
+    string_view text() const { return contents; }
+};
+
+// Replaces `filename` with the concatenation of `pieces`, written without
+// assembling them into one buffer first.
+bool writeFile(const string& filename, initializer_list<string_view> pieces) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
     
-    Token getNextToken() {
-        while (currentChar() != '\0') {
-            skipWhitespace();
-            
-            if (currentChar() == '/' && peekChar() == '/') {
-                skipComments();
-                continue;
-            }
-            
-            int tokenLine = line;
-            int tokenColumn = column;
-            
-            if (isalpha(currentChar()) || currentChar() == '_') {
-                string identifier = readIdentifier();
-                TokenType type = TokenType::TOKEN_IDENTIFIER;
-                
-                if (identifier == "int") type = TokenType::TOKEN_INT;
-                else if (identifier == "if") type = TokenType::TOKEN_IF;
-                
-                return Token(type, identifier, tokenLine, tokenColumn);
-            }
-            
-            if (isdigit(currentChar())) {
-                string number = readNumber();
-                return Token(TokenType::TOKEN_NUMBER, number, tokenLine, tokenColumn);
-            }
-            
-            char ch = currentChar();
-            advance();
-            
-            switch (ch) {
-                case '=':
-                    if (currentChar() == '=') {
-                        advance();
-                        return Token(TokenType::TOKEN_EQUAL, "==", tokenLine, tokenColumn);
-                    }
-                    return Token(TokenType::TOKEN_ASSIGN, "=", tokenLine, tokenColumn);
-                case '+':
-                    return Token(TokenType::TOKEN_PLUS, "+", tokenLine, tokenColumn);
-                case '-':
-                    return Token(TokenType::TOKEN_MINUS, "-", tokenLine, tokenColumn);
-                case '(':
-                    return Token(TokenType::TOKEN_LPAREN, "(", tokenLine, tokenColumn);
-                case ')':
-                    return Token(TokenType::TOKEN_RPAREN, ")", tokenLine, tokenColumn);
-                case '{':
-                    return Token(TokenType::TOKEN_LBRACE, "{", tokenLine, tokenColumn);
-                case '}':
-                    return Token(TokenType::TOKEN_RBRACE, "}", tokenLine, tokenColumn);
-                case ';':
-                    return Token(TokenType::TOKEN_SEMICOLON, ";", tokenLine, tokenColumn);
-                default:
-                    return Token(TokenType::TOKEN_UNKNOWN, string(1, ch), tokenLine, tokenColumn);
+    for (string_view data : pieces) {
+        while (!data.empty()) {
+            ssize_t written = write(fd, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                close(fd);
+                return false;
             }
+            data.remove_prefix((size_t)written);
         }
-        
-        return Token(TokenType::TOKEN_EOF, "", line, column);
     }
-};
+    return close(fd) == 0;
+}
+
+bool writeFile(const string& filename, string_view data) {
+    return writeFile(filename, {data});
+}
 
 // =============================================================================
-// AST NODE DEFINITIONS
+// SYMBOL TABLE
 // =============================================================================
 
-enum class ASTNodeType {
-    PROGRAM,
-    VARIABLE_DECLARATION,
-    ASSIGNMENT,
-    BINARY_OPERATION,
-    IDENTIFIER,
-    NUMBER,
-    IF_STATEMENT
-};
+// Interns identifier spellings into dense integer IDs (0, 1, 2, ...) so later
+// phases can key per-variable data by plain vector index. The table owns
+// copies of the spellings, so it may outlive the source buffer it was fed from.
+using SymbolId = uint32_t;
 
-class ASTNode {
-public:
-    ASTNodeType type;
+class SymbolTable {
+private:
+    deque<string> spellings;   // deque: stable addresses for the map's keys
+    unordered_map<string_view, SymbolId> ids;
     
-    ASTNode(ASTNodeType t) : type(t) {}
-    virtual ~ASTNode() = default;
-};
-
-class ProgramNode : public ASTNode {
 public:
-    vector<shared_ptr<ASTNode>> statements;
+    SymbolId intern(string_view name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        
+        SymbolId id = (SymbolId)spellings.size();
+        spellings.emplace_back(name);
+        ids.emplace(spellings.back(), id);
+        return id;
+    }
     
-    ProgramNode() : ASTNode(ASTNodeType::PROGRAM) {}
-};
-
-class VariableDeclarationNode : public ASTNode {
-public:
-    string variableName;
+    const string& name(SymbolId id) const { return spellings[id]; }
+    size_t size() const { return spellings.size(); }
     
-    VariableDeclarationNode(const string& name) 
-        : ASTNode(ASTNodeType::VARIABLE_DECLARATION), variableName(name) {}
+    // Forgets every symbol; the hash table keeps its buckets.
+    void clear() {
+        ids.clear();
+        spellings.clear();
+    }
 };
 
-class AssignmentNode : public ASTNode {
-public:
-    string variableName;
-    shared_ptr<ASTNode> expression;
-    
-    AssignmentNode(const string& name, shared_ptr<ASTNode> expr) 
-        : ASTNode(ASTNodeType::ASSIGNMENT), variableName(name), expression(expr) {}
-};
+// Whether `name` is one of the variables whose final values are the result
+// of the program: listed exactly or matched by a "prefix*" pattern. An empty
+// list means every variable.
+bool isOutputVariable(const vector<string>& outputs, string_view name) {
+    if (outputs.empty()) return true;
+    for (const string& output : outputs) {
+        if (!output.empty() && output.back() == '*') {
+            if (name.substr(0, output.size() - 1) == string_view(output).substr(0, output.size() - 1)) {
+                return true;
+            }
+        } else if (name == output) {
+            return true;
+        }
+    }
+    return false;
+}
 
-class BinaryOperationNode : public ASTNode {
-public:
-    shared_ptr<ASTNode> left;
-    string operator_;
-    shared_ptr<ASTNode> right;
-    
-    BinaryOperationNode(shared_ptr<ASTNode> l, const string& op, shared_ptr<ASTNode> r) 
-        : ASTNode(ASTNodeType::BINARY_OPERATION), left(l), operator_(op), right(r) {}
-};
+// =============================================================================
+// LEXER CLASS
+// =============================================================================
 
-class IdentifierNode : public ASTNode {
-public:
-    string name;
-    
-    IdentifierNode(const string& n) : ASTNode(ASTNodeType::IDENTIFIER), name(n) {}
+// Character classes for the scanner, one table lookup per byte instead of
+// the locale-aware <cctype> calls. Only ASCII letters, digits and the six
+// C-locale whitespace characters are classified, exactly as isalpha /
+// isdigit / isspace behave in the "C" locale the compiler runs in.
+enum CharClass : uint8_t {
+    CHAR_SPACE = 1,
+    CHAR_IDENT_START = 2,
+    CHAR_IDENT = 4,    // Letters, digits and '_'
+    CHAR_DIGIT = 8,
 };
 
-class NumberNode : public ASTNode {
-public:
-    int value;
+struct CharClassTable {
+    uint8_t classes[256];
     
-    NumberNode(int v) : ASTNode(ASTNodeType::NUMBER), value(v) {}
+    constexpr CharClassTable() : classes() {
+        for (int c : {' ', '\t', '\n', '\v', '\f', '\r'}) classes[c] = CHAR_SPACE;
+        for (int c = 'a'; c <= 'z'; c++) classes[c] = CHAR_IDENT_START | CHAR_IDENT;
+        for (int c = 'A'; c <= 'Z'; c++) classes[c] = CHAR_IDENT_START | CHAR_IDENT;
+        classes['_'] = CHAR_IDENT_START | CHAR_IDENT;
+        for (int c = '0'; c <= '9'; c++) classes[c] = CHAR_DIGIT | CHAR_IDENT;
+    }
 };
 
-class IfStatementNode : public ASTNode {
-public:
-    shared_ptr<ASTNode> condition;
-    shared_ptr<ASTNode> thenStatement;
-    
-    IfStatementNode(shared_ptr<ASTNode> cond, shared_ptr<ASTNode> then) 
-        : ASTNode(ASTNodeType::IF_STATEMENT), condition(cond), thenStatement(then) {}
-};
+constexpr CharClassTable CHAR_CLASSES;
 
-// =============================================================================
-// PARSER CLASS
-// =============================================================================
+inline bool hasClass(char c, uint8_t charClass) {
+    return CHAR_CLASSES.classes[(unsigned char)c] & charClass;
+}
 
-class Parser {
+// The source must be followed by a '\0' sentinel byte (SourceBuffer and
+// std::string both guarantee one), so the scanner never checks bounds: a
+// NUL ends the input just as it always has.
+class Lexer {
 private:
-    vector<Token> tokens;
-    size_t position;
-    
-    Token currentToken() {
-        if (position >= tokens.size()) 
-            return Token(TokenType::TOKEN_EOF);
-        return tokens[position];
-    }
-    
-    Token peekToken() {
-        if (position + 1 >= tokens.size()) 
-            return Token(TokenType::TOKEN_EOF);
-        return tokens[position + 1];
-    }
+    SymbolTable& symbols;
+    const char* cursor;
+    const char* lineStart;   // First byte of the current line, for columns
+    int line;
+    DiagnosticSink* trace;
+    PhaseStats* stats;
+    uint64_t tokenCount;
+    vector<Diagnostic>* diagnostics;
     
-    void advance() {
-        if (position < tokens.size()) position++;
+    int column(const char* at) const {
+        return (int)(at - lineStart) + 1;
     }
     
-    bool match(TokenType expected) {
-        if (currentToken().type == expected) {
-            advance();
-            return true;
+    // Both skips read whole aligned 16-byte blocks. An aligned block never
+    // crosses a page boundary, so reading up to the end of the block that
+    // holds the sentinel is safe even when the source is memory-mapped
+    // (AddressSanitizer cannot know that, hence the attribute).
+    __attribute__((no_sanitize_address))
+    void skipWhitespace() {
+        // Most runs are a single space or a newline; only longer ones
+        // (indentation, blank lines) are worth a vector scan.
+        for (int i = 0; i < 2; i++) {
+            if (!hasClass(*cursor, CHAR_SPACE)) return;
+            if (*cursor == '\n') {
+                line++;
+                lineStart = cursor + 1;
+            }
+            cursor++;
         }
-        return false;
+#ifdef __SSE2__
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i belowTab = _mm_set1_epi8('\t' - 1);
+        const __m128i aboveReturn = _mm_set1_epi8('\r' + 1);
+        while (true) {
+            const char* block = (const char*)((uintptr_t)cursor & ~(uintptr_t)15);
+            unsigned offset = (unsigned)(cursor - block);
+            __m128i bytes = _mm_load_si128((const __m128i*)block);
+            __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(bytes, space), 
+                                           _mm_and_si128(_mm_cmpgt_epi8(bytes, belowTab), 
+                                                         _mm_cmplt_epi8(bytes, aboveReturn)));
+            unsigned spaces = (unsigned)_mm_movemask_epi8(isSpace) >> offset;
+            unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) >> offset;
+            unsigned stops = ~spaces & (0xFFFFu >> offset);
+            unsigned length = stops ? (unsigned)__builtin_ctz(stops) : 16 - offset;
+            
+            newlines &= (1u << length) - 1;
+            if (newlines) {
+                line += __builtin_popcount(newlines);
+                lineStart = cursor + (31 - __builtin_clz(newlines)) + 1;
+            }
+            cursor += length;
+            if (stops) return;
+        }
+#else
+        while (hasClass(*cursor, CHAR_SPACE)) {
+            if (*cursor == '\n') {
+                line++;
+                lineStart = cursor + 1;
+            }
+            cursor++;
+        }
+#endif
     }
     
-    void expect(TokenType expected) {
-        if (!match(expected)) {
-            throw runtime_error("Parse error at line " + to_string(currentToken().line) + 
-                              ": expected token type " + to_string((int)expected));
+    // Moves to the '\n' (or sentinel) ending a // comment.
+    __attribute__((no_sanitize_address))
+    void skipCommentBody() {
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i zero = _mm_setzero_si128();
+        while (true) {
+            const char* block = (const char*)((uintptr_t)cursor & ~(uintptr_t)15);
+            unsigned offset = (unsigned)(cursor - block);
+            __m128i bytes = _mm_load_si128((const __m128i*)block);
+            unsigned stops = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, newline), 
+                                                                       _mm_cmpeq_epi8(bytes, zero))) >> offset;
+            if (stops) {
+                cursor += __builtin_ctz(stops);
+                return;
+            }
+            cursor = block + 16;
+        }
+#else
+        while (*cursor != '\n' && *cursor != '\0') {
+            cursor++;
         }
+#endif
     }
     
-    shared_ptr<ASTNode> parseExpression() {
-        return parseAdditionExpression();
+    // Keywords are told apart by a perfect hash of length and first byte,
+    // so each identifier costs one table probe and at most one compare.
+    TokenType keywordType(string_view identifier) const {
+        struct Keyword {
+            string_view spelling;
+            TokenType type;
+        };
+        static const Keyword KEYWORDS[4] = {
+            {"int", TokenType::TOKEN_INT},             // (3 + 'i') & 3 == 0
+            {{}, TokenType::TOKEN_IDENTIFIER},
+            {{}, TokenType::TOKEN_IDENTIFIER},
+            {"if", TokenType::TOKEN_IF},               // (2 + 'i') & 3 == 3
+        };
+        if (identifier.size() > 3) return TokenType::TOKEN_IDENTIFIER;
+        const Keyword& keyword = KEYWORDS[(identifier.size() + (unsigned char)identifier[0]) & 3];
+        return keyword.spelling == identifier ? keyword.type : TokenType::TOKEN_IDENTIFIER;
     }
     
-    shared_ptr<ASTNode> parseAdditionExpression() {
-        shared_ptr<ASTNode> left = parsePrimaryExpression();
-        
-        while (currentToken().type == TokenType::TOKEN_PLUS || 
-               currentToken().type == TokenType::TOKEN_MINUS) {
-            string op = currentToken().text;
-            advance();
-            shared_ptr<ASTNode> right = parsePrimaryExpression();
-            left = make_shared<BinaryOperationNode>(left, op, right);
+    string_view readIdentifier() {
+        const char* start = cursor;
+        while (hasClass(*cursor, CHAR_IDENT)) {
+            cursor++;
         }
-        
-        return left;
+        return string_view(start, cursor - start);
     }
     
-    shared_ptr<ASTNode> parsePrimaryExpression() {
-        Token token = currentToken();
-        
-        if (token.type == TokenType::TOKEN_NUMBER) {
-            advance();
-            return make_shared<NumberNode>(stoi(token.text));
-        }
-        
-        if (token.type == TokenType::TOKEN_IDENTIFIER) {
-            advance();
-            return make_shared<IdentifierNode>(token.text);
+    // An oversized literal is reported and scanned as 0, so parsing goes on.
+    string_view readNumber(int& value) {
+        const char* start = cursor;
+        long long result = 0;
+        while (hasClass(*cursor, CHAR_DIGIT)) {
+            if (result <= INT_MAX) result = result * 10 + (*cursor - '0');
+            cursor++;
         }
-        
-        if (token.type == TokenType::TOKEN_LPAREN) {
-            advance();
-            shared_ptr<ASTNode> expr = parseExpression();
-            expect(TokenType::TOKEN_RPAREN);
-            return expr;
+        if (result > INT_MAX) {
+            if (diagnostics) {
+                diagnostics->push_back({line, column(start), "number literal too large"});
+            }
+            result = 0;
         }
-        
-        throw runtime_error("Parse error at line " + to_string(token.line) + 
-                          ": unexpected token in expression");
+        value = (int)result;
+        return string_view(start, cursor - start);
     }
     
-    shared_ptr<ASTNode> parseComparison() {
-        shared_ptr<ASTNode> left = parseExpression();
-        
-        if (currentToken().type == TokenType::TOKEN_EQUAL) {
-            string op = currentToken().text;
-            advance();
-            shared_ptr<ASTNode> right = parseExpression();
-            return make_shared<BinaryOperationNode>(left, op, right);
+    Token scanToken() {
+        while (true) {
+            if (hasClass(*cursor, CHAR_SPACE)) skipWhitespace();
+            if (*cursor == '/' && cursor[1] == '/') {
+                skipCommentBody();
+                continue;
+            }
+            break;
         }
         
-        return left;
-    }
-    
-    shared_ptr<ASTNode> parseStatement() {
-        Token token = currentToken();
+        const char* start = cursor;
+        int tokenLine = line;
+        int tokenColumn = column(start);
+        char ch = *cursor;
         
-        // Variable declaration
-        if (token.type == TokenType::TOKEN_INT) {
-            advance();
-            if (currentToken().type != TokenType::TOKEN_IDENTIFIER) {
-                throw runtime_error("Parse error: expected identifier after 'int'");
-            }
-            string varName = currentToken().text;
-            advance();
-            expect(TokenType::TOKEN_SEMICOLON);
-            return make_shared<VariableDeclarationNode>(varName);
+        if (hasClass(ch, CHAR_IDENT_START)) {
+            string_view identifier = readIdentifier();
+            TokenType type = keywordType(identifier);
+            int symbol = type == TokenType::TOKEN_IDENTIFIER ? (int)symbols.intern(identifier) : 0;
+            return Token(type, identifier, tokenLine, tokenColumn, symbol);
         }
         
-        // Assignment
-        if (token.type == TokenType::TOKEN_IDENTIFIER) {
-            string varName = token.text;
-            advance();
-            expect(TokenType::TOKEN_ASSIGN);
-            shared_ptr<ASTNode> expr = parseExpression();
-            expect(TokenType::TOKEN_SEMICOLON);
-            return make_shared<AssignmentNode>(varName, expr);
+        if (hasClass(ch, CHAR_DIGIT)) {
+            int value;
+            string_view number = readNumber(value);
+            return Token(TokenType::TOKEN_NUMBER, number, tokenLine, tokenColumn, value);
         }
         
-        // If statement
-        if (token.type == TokenType::TOKEN_IF) {
-            advance();
-            expect(TokenType::TOKEN_LPAREN);
-            shared_ptr<ASTNode> condition = parseComparison();
-            expect(TokenType::TOKEN_RPAREN);
-            expect(TokenType::TOKEN_LBRACE);
-            shared_ptr<ASTNode> thenStmt = parseStatement();
-            expect(TokenType::TOKEN_RBRACE);
-            return make_shared<IfStatementNode>(condition, thenStmt);
+        if (ch == '\0') {
+            return Token(TokenType::TOKEN_EOF, {}, tokenLine, tokenColumn);
         }
         
-        throw runtime_error("Parse error at line " + to_string(token.line) + 
-                          ": unexpected token in statement");
+        cursor++;
+        switch (ch) {
+            case '=':
+                if (*cursor == '=') {
+                    cursor++;
+                    return Token(TokenType::TOKEN_EQUAL, string_view(start, 2), tokenLine, tokenColumn);
+                }
+                return Token(TokenType::TOKEN_ASSIGN, string_view(start, 1), tokenLine, tokenColumn);
+            case '+':
+                return Token(TokenType::TOKEN_PLUS, string_view(start, 1), tokenLine, tokenColumn);
+            case '-':
+                return Token(TokenType::TOKEN_MINUS, string_view(start, 1), tokenLine, tokenColumn);
+            case '(':
+                return Token(TokenType::TOKEN_LPAREN, string_view(start, 1), tokenLine, tokenColumn);
+            case ')':
+                return Token(TokenType::TOKEN_RPAREN, string_view(start, 1), tokenLine, tokenColumn);
+            case '{':
+                return Token(TokenType::TOKEN_LBRACE, string_view(start, 1), tokenLine, tokenColumn);
+            case '}':
+                return Token(TokenType::TOKEN_RBRACE, string_view(start, 1), tokenLine, tokenColumn);
+            case ';':
+                return Token(TokenType::TOKEN_SEMICOLON, string_view(start, 1), tokenLine, tokenColumn);
+            default:
+                return Token(TokenType::TOKEN_UNKNOWN, string_view(start, 1), tokenLine, tokenColumn);
+        }
     }
     
 public:
-    Parser(const vector<Token>& toks) : tokens(toks), position(0) {}
+    Lexer(string_view src, SymbolTable& table) 
+        : symbols(table), cursor(src.data()), lineStart(src.data()), line(1), 
+          trace(nullptr), stats(nullptr), tokenCount(0), diagnostics(nullptr) {}
     
-    shared_ptr<ProgramNode> parse() {
-        auto program = make_shared<ProgramNode>();
-        
-        while (currentToken().type != TokenType::TOKEN_EOF) {
-            try {
-                auto stmt = parseStatement();
-                program->statements.push_back(stmt);
-            } catch (const runtime_error& e) {
-                cerr << "Parser error: " << e.what() << endl;
-                break;
+    // Lexical errors are appended here (nullptr ignores them).
+    void setDiagnostics(vector<Diagnostic>* list) {
+        diagnostics = list;
+    }
+    
+    // Echo every token produced to the given sink (nullptr disables).
+    void setTrace(DiagnosticSink* sink) {
+        trace = sink;
+    }
+    
+    // Charge time and allocations spent scanning to the given phase. Costs a
+    // clock read per token, so it is only enabled when statistics are wanted.
+    void setStats(PhaseStats* lexStats) {
+        stats = lexStats;
+    }
+    
+    uint64_t getTokenCount() const {
+        return tokenCount;
+    }
+    
+    Token getNextToken() {
+        Token token;
+        if (stats) {
+            PhaseTimer timer(*stats);
+            token = scanToken();
+        } else {
+            token = scanToken();
+        }
+        if (token.type != TokenType::TOKEN_EOF) tokenCount++;
+        if (trace && token.type != TokenType::TOKEN_EOF) {
+            *trace << "Token: " << (int)token.type << " '" << token.text 
+                   << "' at line " << token.line << '\n';
+        }
+        return token;
+    }
+};
+
+// =============================================================================
+// AST NODE DEFINITIONS
+// =============================================================================
+
+enum class ASTNodeType : uint8_t {
+    VARIABLE_DECLARATION,
+    ASSIGNMENT,
+    BINARY_OPERATION,
+    IDENTIFIER,
+    NUMBER,
+    IF_STATEMENT
+};
+
+enum class BinaryOperator : uint8_t {
+    ADD,
+    SUBTRACT,
+    EQUAL
+};
+
+// Nodes are stored by value in a flat pool owned by the AST and refer to each
+// other through 32-bit indices, so building and walking the tree involves no
+// per-node heap allocation and no reference counting.
+using NodeId = uint32_t;
+const NodeId INVALID_NODE = UINT32_MAX;
+
+struct ASTNode {
+    ASTNodeType type;
+    BinaryOperator op;   // BINARY_OPERATION
+    NodeId left;         // BINARY_OPERATION lhs, ASSIGNMENT expression, IF_STATEMENT condition
+    NodeId right;        // BINARY_OPERATION rhs, IF_STATEMENT then-statement
+    int32_t value;       // NUMBER literal
+    SymbolId symbol;     // VARIABLE_DECLARATION, ASSIGNMENT, IDENTIFIER
+};
+
+class AST {
+public:
+    vector<ASTNode> nodes;
+    vector<NodeId> statements;   // Top-level program statements in source order
+    
+    const ASTNode& operator[](NodeId id) const { return nodes[id]; }
+    ASTNode& operator[](NodeId id) { return nodes[id]; }
+    
+    // Empties the tree but keeps the pool's capacity for the next one.
+    void clear() {
+        nodes.clear();
+        statements.clear();
+    }
+    
+    // Writes an indented outline of the tree.
+    void dump(const SymbolTable& symbols, DiagnosticSink& out) const {
+        out << "Program (" << statements.size() << " statements)\n";
+        for (NodeId stmt : statements) {
+            dumpNode(stmt, 1, symbols, out);
+        }
+    }
+    
+    NodeId makeVariableDeclaration(SymbolId symbol) {
+        return add({ASTNodeType::VARIABLE_DECLARATION, BinaryOperator::ADD, INVALID_NODE, INVALID_NODE, 0, symbol});
+    }
+    
+    NodeId makeAssignment(SymbolId symbol, NodeId expression) {
+        return add({ASTNodeType::ASSIGNMENT, BinaryOperator::ADD, expression, INVALID_NODE, 0, symbol});
+    }
+    
+    NodeId makeBinaryOperation(NodeId left, BinaryOperator op, NodeId right) {
+        return add({ASTNodeType::BINARY_OPERATION, op, left, right, 0, 0});
+    }
+    
+    NodeId makeIdentifier(SymbolId symbol) {
+        return add({ASTNodeType::IDENTIFIER, BinaryOperator::ADD, INVALID_NODE, INVALID_NODE, 0, symbol});
+    }
+    
+    NodeId makeNumber(int value) {
+        return add({ASTNodeType::NUMBER, BinaryOperator::ADD, INVALID_NODE, INVALID_NODE, value, 0});
+    }
+    
+    NodeId makeIfStatement(NodeId condition, NodeId thenStatement) {
+        return add({ASTNodeType::IF_STATEMENT, BinaryOperator::ADD, condition, thenStatement, 0, 0});
+    }
+    
+private:
+    // Pre-order walk with an explicit stack, so nesting depth is not
+    // limited by the native stack.
+    void dumpNode(NodeId root, int rootDepth, const SymbolTable& symbols, DiagnosticSink& out) const {
+        vector<pair<NodeId, int>> pending = {{root, rootDepth}};
+        while (!pending.empty()) {
+            auto [id, depth] = pending.back();
+            pending.pop_back();
+            
+            const ASTNode& node = nodes[id];
+            out << string_view("                                ", min(2 * depth, 32));
+            switch (node.type) {
+                case ASTNodeType::VARIABLE_DECLARATION:
+                    out << "VariableDeclaration " << symbols.name(node.symbol) << '\n';
+                    break;
+                case ASTNodeType::ASSIGNMENT:
+                    out << "Assignment " << symbols.name(node.symbol) << '\n';
+                    pending.push_back({node.left, depth + 1});
+                    break;
+                case ASTNodeType::BINARY_OPERATION:
+                    out << "BinaryOperation " << (node.op == BinaryOperator::ADD ? "+" : 
+                                                  node.op == BinaryOperator::SUBTRACT ? "-" : "==") << '\n';
+                    pending.push_back({node.right, depth + 1});
+                    pending.push_back({node.left, depth + 1});
+                    break;
+                case ASTNodeType::IDENTIFIER:
+                    out << "Identifier " << symbols.name(node.symbol) << '\n';
+                    break;
+                case ASTNodeType::NUMBER:
+                    out << "Number " << node.value << '\n';
+                    break;
+                case ASTNodeType::IF_STATEMENT:
+                    out << "If\n";
+                    pending.push_back({node.right, depth + 1});
+                    pending.push_back({node.left, depth + 1});
+                    break;
             }
         }
-        
-        return program;
+    }
+    
+    NodeId add(const ASTNode& node) {
+        nodes.push_back(node);
+        return (NodeId)(nodes.size() - 1);
     }
 };
 
 // =============================================================================
-// CODE GENERATOR CLASS
+// PARSER CLASS
 // =============================================================================
 
-class CodeGenerator {
+// The parser pulls tokens from the lexer on demand through a two-slot
+// lookahead ring, so token memory stays constant regardless of input size.
+// References returned by currentToken()/peekToken() are only valid until
+// the next advance().
+class Parser {
 private:
-    map<string, int> variableAddresses;
-    int nextAddress;
-    vector<string> assembly;
-    int labelCounter;
+    static const size_t LOOKAHEAD = 2;
+    
+    Lexer& lexer;
+    Token lookahead[LOOKAHEAD];
+    size_t head;
+    AST ast;
+    vector<Diagnostic> diagnostics;
+    size_t openBraces;                       // '{' consumed by the current statement
+    const char* consumedEnd;                 // One past the last consumed token
+    vector<const char*>* statementEnds;      // Optional, see recordStatementEnds
+    vector<NodeId> operands;                 // parseExpression's stacks, kept for reuse
+    vector<uint8_t> operators;               // PENDING_* entries
+    vector<NodeId> conditions;               // Enclosing if conditions in parseStatement
     
-    string generateLabel() {
-        return "L" + to_string(labelCounter++);
+    static constexpr uint8_t PENDING_ADD = 0;
+    static constexpr uint8_t PENDING_SUBTRACT = 1;
+    static constexpr uint8_t PENDING_PAREN = 2;
+    
+    const Token& currentToken() {
+        return lookahead[head];
     }
     
-    void generateExpression(shared_ptr<ASTNode> node) {
-        switch (node->type) {
-            case ASTNodeType::NUMBER: {
-                auto numNode = static_pointer_cast<NumberNode>(node);
-                assembly.push_back("    LDA #" + to_string(numNode->value) + "  ; Load immediate value");
-                break;
+    const Token& peekToken() {
+        return lookahead[(head + 1) % LOOKAHEAD];
+    }
+    
+    void advance() {
+        if (lookahead[head].type == TokenType::TOKEN_EOF) return;
+        consumedEnd = lookahead[head].text.data() + lookahead[head].text.size();
+        lookahead[head] = lexer.getNextToken();
+        head = (head + 1) % LOOKAHEAD;
+    }
+    
+    bool match(TokenType expected) {
+        if (currentToken().type == expected) {
+            advance();
+            return true;
+        }
+        return false;
+    }
+    
+    static string describe(const Token& token) {
+        if (token.type == TokenType::TOKEN_EOF) return "end of input";
+        return "'" + string(token.text) + "'";
+    }
+    
+    void expect(TokenType expected) {
+        if (!match(expected)) {
+            throw SyntaxError(currentToken(), string("expected ") + tokenTypeName(expected) + 
+                              " but found " + describe(currentToken()));
+        }
+    }
+    
+    // Shunting-yard over the expression grammar
+    //     expression := primary (('+' | '-') primary)*
+    //     primary    := NUMBER | IDENTIFIER | '(' expression ')'
+    // with explicit operand and operator stacks, so parenthesis depth costs
+    // heap, not native stack. '+' and '-' share one left-associative level,
+    // so each parenthesis level holds at most one pending operator, reduced
+    // as soon as its right operand is complete. Nodes are created in the
+    // same order as a recursive descent parser would create them.
+    NodeId parseExpression() {
+        size_t operandBase = operands.size();
+        size_t operatorBase = operators.size();
+        size_t openParens = 0;
+        
+        auto pendingOperator = [&]() {
+            return operators.size() > operatorBase && operators.back() != PENDING_PAREN;
+        };
+        
+        while (true) {
+            const Token& token = currentToken();
+            if (token.type == TokenType::TOKEN_LPAREN) {
+                operators.push_back(PENDING_PAREN);
+                openParens++;
+                advance();
+                continue;
             }
-            
-            case ASTNodeType::IDENTIFIER: {
-                auto idNode = static_pointer_cast<IdentifierNode>(node);
-                if (variableAddresses.find(idNode->name) == variableAddresses.end()) {
-                    throw runtime_error("Undefined variable: " + idNode->name);
-                }
-                assembly.push_back("    LDA $" + to_string(variableAddresses[idNode->name]) + "  ; Load variable " + idNode->name);
-                break;
+            if (token.type == TokenType::TOKEN_NUMBER) {
+                operands.push_back(ast.makeNumber(token.value));
+            } else if (token.type == TokenType::TOKEN_IDENTIFIER) {
+                operands.push_back(ast.makeIdentifier((SymbolId)token.value));
+            } else {
+                throw SyntaxError(token, "expected expression but found " + describe(token));
             }
+            advance();
             
-            case ASTNodeType::BINARY_OPERATION: {
-                auto binNode = static_pointer_cast<BinaryOperationNode>(node);
-                
-                if (binNode->operator_ == "==") {
-                    // Generate comparison
-                    generateExpression(binNode->left);
-                    assembly.push_back("    PHA              ; Push left operand");
-                    generateExpression(binNode->right);
-                    assembly.push_back("    TAX              ; Transfer A to X");
-                    assembly.push_back("    PLA              ; Pop left operand");
-                    assembly.push_back("    CMP X            ; Compare A with X");
-                } else {
-                    // Generate left operand
-                    generateExpression(binNode->left);
-                    assembly.push_back("    PHA              ; Push left operand");
-                    
-                    // Generate right operand
-                    generateExpression(binNode->right);
-                    assembly.push_back("    TAX              ; Transfer A to X");
-                    assembly.push_back("    PLA              ; Pop left operand");
-                    
-                    // Perform operation
-                    if (binNode->operator_ == "+") {
-                        assembly.push_back("    ADC X            ; Add X to A");
-                    } else if (binNode->operator_ == "-") {
-                        assembly.push_back("    SBC X            ; Subtract X from A");
-                    }
+            // A primary is complete: combine it with the operator waiting for
+            // it, and keep going while it also closes a parenthesis.
+            while (true) {
+                if (pendingOperator()) {
+                    NodeId right = operands.back();
+                    operands.pop_back();
+                    BinaryOperator op = operators.back() == PENDING_ADD ? BinaryOperator::ADD 
+                                                                         : BinaryOperator::SUBTRACT;
+                    operators.pop_back();
+                    operands.back() = ast.makeBinaryOperation(operands.back(), op, right);
                 }
-                break;
+                if (openParens == 0 || currentToken().type != TokenType::TOKEN_RPAREN) break;
+                operators.pop_back();
+                openParens--;
+                advance();
             }
             
-            default:
-                throw runtime_error("Unsupported expression type in code generation");
+            TokenType next = currentToken().type;
+            if (next != TokenType::TOKEN_PLUS && next != TokenType::TOKEN_MINUS) break;
+            operators.push_back(next == TokenType::TOKEN_PLUS ? PENDING_ADD : PENDING_SUBTRACT);
+            advance();
         }
+        
+        // Still inside parentheses: report the missing ')'
+        if (openParens > 0) expect(TokenType::TOKEN_RPAREN);
+        
+        NodeId result = operands.back();
+        operands.resize(operandBase);
+        return result;
     }
     
-public:
-    CodeGenerator() : nextAddress(0x80), labelCounter(0) {
-        assembly.push_back("; SimpleLang Compiler Output");
-        assembly.push_back("; Generated Assembly for 8-bit CPU");
-        assembly.push_back("");
+    NodeId parseComparison() {
+        NodeId left = parseExpression();
+        
+        if (currentToken().type == TokenType::TOKEN_EQUAL) {
+            advance();
+            NodeId right = parseExpression();
+            return ast.makeBinaryOperation(left, BinaryOperator::EQUAL, right);
+        }
+        
+        return left;
     }
     
-    void generateCode(shared_ptr<ProgramNode> program) {
-        for (auto& stmt : program->statements) {
-            generateStatement(stmt);
+    // An if's body is a single statement, so nested ifs form a chain: the
+    // conditions are collected on the way in and the if nodes are built on
+    // the way out, with no recursion.
+    NodeId parseStatement() {
+        size_t conditionBase = conditions.size();
+        
+        // If statement
+        while (currentToken().type == TokenType::TOKEN_IF) {
+            advance();
+            expect(TokenType::TOKEN_LPAREN);
+            conditions.push_back(parseComparison());
+            expect(TokenType::TOKEN_RPAREN);
+            expect(TokenType::TOKEN_LBRACE);
+            openBraces++;
         }
         
-        // Add program termination
-        assembly.push_back("");
-        assembly.push_back("    HLT              ; Halt the processor");
+        NodeId stmt = parseSimpleStatement();
+        
+        while (conditions.size() > conditionBase) {
+            expect(TokenType::TOKEN_RBRACE);
+            openBraces--;
+            stmt = ast.makeIfStatement(conditions.back(), stmt);
+            conditions.pop_back();
+        }
+        return stmt;
     }
     
-    void generateStatement(shared_ptr<ASTNode> node) {
-        switch (node->type) {
-            case ASTNodeType::VARIABLE_DECLARATION: {
-                auto varNode = static_pointer_cast<VariableDeclarationNode>(node);
-                variableAddresses[varNode->variableName] = nextAddress++;
-                assembly.push_back("; Declare variable: " + varNode->variableName + 
-                                 " at address $" + to_string(variableAddresses[varNode->variableName]));
-                break;
+    NodeId parseSimpleStatement() {
+        const Token& token = currentToken();
+        
+        // Variable declaration
+        if (token.type == TokenType::TOKEN_INT) {
+            advance();
+            if (currentToken().type != TokenType::TOKEN_IDENTIFIER) {
+                throw SyntaxError(currentToken(), "expected identifier after 'int' but found " + 
+                                  describe(currentToken()));
             }
-            
-            case ASTNodeType::ASSIGNMENT: {
-                auto assignNode = static_pointer_cast<AssignmentNode>(node);
-                assembly.push_back("; Assignment: " + assignNode->variableName);
-                
-                generateExpression(assignNode->expression);
-                
-                if (variableAddresses.find(assignNode->variableName) == variableAddresses.end()) {
-                    throw runtime_error("Undefined variable: " + assignNode->variableName);
+            NodeId decl = ast.makeVariableDeclaration((SymbolId)currentToken().value);
+            advance();
+            expect(TokenType::TOKEN_SEMICOLON);
+            return decl;
+        }
+        
+        // Assignment
+        if (token.type == TokenType::TOKEN_IDENTIFIER) {
+            SymbolId target = (SymbolId)token.value;
+            advance();
+            expect(TokenType::TOKEN_ASSIGN);
+            NodeId expr = parseExpression();
+            expect(TokenType::TOKEN_SEMICOLON);
+            return ast.makeAssignment(target, expr);
+        }
+        
+        throw SyntaxError(token, "expected statement but found " + describe(token));
+    }
+    
+    // Panic-mode recovery: skip to the end of the statement that failed, i.e.
+    // past its ';' and the '}' of every if it had opened, or past a '}' that
+    // closes nothing. Braces opened while skipping are balanced as well.
+    void synchronize() {
+        size_t depth = openBraces;
+        openBraces = 0;
+        while (true) {
+            TokenType type = currentToken().type;
+            if (type == TokenType::TOKEN_EOF) return;
+            advance();
+            if (type == TokenType::TOKEN_LBRACE) {
+                depth++;
+            } else if (type == TokenType::TOKEN_RBRACE) {
+                if (depth == 0 || --depth == 0) return;
+            } else if (type == TokenType::TOKEN_SEMICOLON) {
+                while (depth > 0 && currentToken().type == TokenType::TOKEN_RBRACE) {
+                    advance();
+                    depth--;
                 }
-                
-                assembly.push_back("    STA $" + to_string(variableAddresses[assignNode->variableName]) + 
-                                 "  ; Store to variable " + assignNode->variableName);
-                break;
-            }
-            
-            case ASTNodeType::IF_STATEMENT: {
-                auto ifNode = static_pointer_cast<IfStatementNode>(node);
-                string endLabel = generateLabel();
-                
-                assembly.push_back("; If statement");
-                generateExpression(ifNode->condition);
-                assembly.push_back("    BNE " + endLabel + "    ; Branch if not equal (condition false)");
-                
-                generateStatement(ifNode->thenStatement);
-                
-                assembly.push_back(endLabel + ":");
-                break;
+                return;
             }
-            
-            default:
-                throw runtime_error("Unsupported statement type in code generation");
         }
-        
-        assembly.push_back("");
     }
     
-    void printAssembly() {
-        for (const string& line : assembly) {
-            cout << line << endl;
+public:
+    Parser(Lexer& lex) 
+        : lexer(lex), head(0), openBraces(0), consumedEnd(nullptr), statementEnds(nullptr) {
+        lexer.setDiagnostics(&diagnostics);
+        for (Token& token : lookahead) {
+            token = lexer.getNextToken();
         }
     }
     
-    void saveAssembly(const string& filename) {
-        ofstream file(filename);
-        if (file.is_open()) {
-            for (const string& line : assembly) {
-                file << line << endl;
+    ~Parser() {
+        lexer.setDiagnostics(nullptr);
+    }
+    
+    // Statements with a syntax error are reported and dropped; the returned
+    // AST holds every statement that parsed.
+    AST parse() {
+        while (currentToken().type != TokenType::TOKEN_EOF) {
+            try {
+                NodeId stmt = parseStatement();
+                ast.statements.push_back(stmt);
+                if (statementEnds) statementEnds->push_back(consumedEnd);
+            } catch (const SyntaxError& e) {
+                diagnostics.push_back({e.line, e.column, e.what()});
+                operands.clear();
+                operators.clear();
+                conditions.clear();
+                synchronize();
             }
-            file.close();
-            cout << "Assembly code saved to " << filename << endl;
-        } else {
-            cerr << "Error: Could not open file " << filename << " for writing" << endl;
         }
+        
+        // The lexer runs ahead of the parser, so its reports may be out of order
+        stable_sort(diagnostics.begin(), diagnostics.end(), 
+                    [](const Diagnostic& a, const Diagnostic& b) {
+                        return a.line != b.line ? a.line < b.line : a.column < b.column;
+                    });
+        return move(ast);
+    }
+    
+    // Builds the tree in `storage`'s buffers, e.g. those of the tree returned
+    // by a previous parse, instead of growing new ones.
+    void reuse(AST&& storage) {
+        ast = move(storage);
+        ast.clear();
+    }
+    
+    // Collect, for each top-level statement, a pointer one past its last
+    // source byte (the closing ';' or '}').
+    void recordStatementEnds(vector<const char*>* ends) {
+        statementEnds = ends;
+    }
+    
+    // Every lexical and syntax error, in source order.
+    const vector<Diagnostic>& getDiagnostics() const {
+        return diagnostics;
+    }
+    
+    bool hasErrors() const {
+        return !diagnostics.empty();
     }
 };
 
 // =============================================================================
-// COMPILER CLASS - MAIN ORCHESTRATOR
+// CONSTANT FOLDING
 // =============================================================================
 
-class SimpleLangCompiler {
+struct FoldReport {
+    size_t foldedOperations = 0;
+    size_t propagatedConstants = 0;
+    size_t eliminatedIfs = 0;
+};
+
+// Folds constant arithmetic, propagates known variable values through
+// straight-line code and removes if statements whose condition is decided at
+// compile time. Values follow the target's 8-bit wraparound semantics.
+// Expressions are rewritten in place: a folded node simply becomes a NUMBER.
+class ConstantFolder {
 private:
-    string sourceCode;
+    static constexpr int UNKNOWN = -1;
     
-public:
-    bool loadSource(const string& filename) {
-        ifstream file(filename);
-        if (!file.is_open()) {
-            cerr << "Error: Could not open source file " << filename << endl;
-            return false;
-        }
-        
-        string line;
-        sourceCode.clear();
-        while (getline(file, line)) {
-            sourceCode += line + "\n";
+    AST& ast;
+    vector<int> known;   // Indexed by SymbolId: 0-255, or UNKNOWN
+    vector<pair<SymbolId, int>> trail;   // (symbol, previous value) for branch merging
+    vector<pair<NodeId, bool>> pending;  // foldExpression's work stack
+    bool flagsRead = false;   // Some condition has no comparison (see fold)
+    FoldReport report;
+    
+    void setKnown(SymbolId symbol, int value) {
+        if (known[symbol] == value) return;
+        trail.push_back({symbol, known[symbol]});
+        known[symbol] = value;
+    }
+    
+    // Post-order walk with an explicit stack: an operation is folded once
+    // both operands have been visited (the flag marks that second visit).
+    void foldExpression(NodeId root) {
+        pending.clear();
+        pending.push_back({root, false});
+        while (!pending.empty()) {
+            auto [id, operandsDone] = pending.back();
+            pending.pop_back();
+            
+            ASTNode& node = ast[id];
+            if (node.type == ASTNodeType::IDENTIFIER) {
+                if (known[node.symbol] != UNKNOWN) {
+                    node.value = known[node.symbol];
+                    node.type = ASTNodeType::NUMBER;
+                    report.propagatedConstants++;
+                }
+                continue;
+            }
+            if (node.type != ASTNodeType::BINARY_OPERATION) continue;
+            
+            if (!operandsDone) {
+                pending.push_back({id, true});
+                pending.push_back({node.right, false});
+                pending.push_back({node.left, false});
+                continue;
+            }
+            
+            const ASTNode& left = ast[node.left];
+            const ASTNode& right = ast[node.right];
+            if (left.type != ASTNodeType::NUMBER || right.type != ASTNodeType::NUMBER) continue;
+            
+            int result = 0;
+            switch (node.op) {
+                // Literals may be as wide as an int, so wrap each operand first
+                case BinaryOperator::ADD:      result = (uint8_t)((uint8_t)left.value + (uint8_t)right.value); break;
+                case BinaryOperator::SUBTRACT: result = (uint8_t)((uint8_t)left.value - (uint8_t)right.value); break;
+                case BinaryOperator::EQUAL:    result = (left.value & 0xFF) == (right.value & 0xFF); break;
+            }
+            node.type = ASTNodeType::NUMBER;
+            node.value = result;
+            report.foldedOperations++;
         }
-        file.close();
-        
-        cout << "Source code loaded from " << filename << endl;
-        return true;
     }
     
-    void setSource(const string& code) {
-        sourceCode = code;
+    // A removed branch still declares its variables: declarations are
+    // compile-time only, so keep one if the branch ends in it.
+    NodeId declarationIn(NodeId id) {
+        while (ast[id].type == ASTNodeType::IF_STATEMENT) {
+            id = ast[id].right;
+        }
+        return ast[id].type == ASTNodeType::VARIABLE_DECLARATION ? id : INVALID_NODE;
     }
     
-    bool compile(const string& outputFilename = "output.asm") {
-        try {
-            cout << "\n=== LEXICAL ANALYSIS ===" << endl;
-            Lexer lexer(sourceCode);
-            vector<Token> tokens;
-            
-            Token token;
-            do {
-                token = lexer.getNextToken();
-                tokens.push_back(token);
-                
-                if (token.type != TokenType::TOKEN_EOF) {
-                    cout << "Token: " << (int)token.type << " '" << token.text 
-                         << "' at line " << token.line << endl;
-                }
-            } while (token.type != TokenType::TOKEN_EOF);
+    // Returns the statement to keep in place of id, or INVALID_NODE to drop it.
+    // Nested ifs form a chain (each body is one statement), walked inward
+    // with the undecided ifs remembered so their branches can be merged
+    // on the way back out.
+    NodeId foldStatement(NodeId id) {
+        struct OpenIf {
+            NodeId id;
+            size_t mark;   // Trail size on entry to the branch
+        };
+        vector<OpenIf> open;
+        
+        NodeId kept = id;
+        while (true) {
+            ASTNode& node = ast[id];
+            if (node.type == ASTNodeType::VARIABLE_DECLARATION) {
+                setKnown(node.symbol, UNKNOWN);
+                kept = id;
+                break;
+            }
+            if (node.type == ASTNodeType::ASSIGNMENT) {
+                foldExpression(node.left);
+                const ASTNode& value = ast[ast[id].left];
+                SymbolId target = ast[id].symbol;
+                setKnown(target, value.type == ASTNodeType::NUMBER ? (value.value & 0xFF) : UNKNOWN);
+                kept = id;
+                break;
+            }
+            if (node.type != ASTNodeType::IF_STATEMENT) {
+                kept = id;
+                break;
+            }
             
-            cout << "\n=== SYNTAX ANALYSIS ===" << endl;
-            Parser parser(tokens);
-            auto ast = parser.parse();
-            cout << "Abstract Syntax Tree generated successfully" << endl;
+            bool isComparison = ast[node.left].type == ASTNodeType::BINARY_OPERATION && 
+                                ast[node.left].op == BinaryOperator::EQUAL;
+            if (isComparison && flagsRead) {
+                // Keep the CMP, and with it the if
+                foldExpression(ast[node.left].left);
+                foldExpression(ast[node.left].right);
+            } else {
+                foldExpression(node.left);
+            }
+            const ASTNode& condition = ast[ast[id].left];
             
-            cout << "\n=== CODE GENERATION ===" << endl;
-            CodeGenerator generator;
-            generator.generateCode(ast);
+            if (isComparison && condition.type == ASTNodeType::NUMBER) {
+                report.eliminatedIfs++;
+                if (condition.value) {
+                    // Always taken: the body replaces the if
+                    id = ast[id].right;
+                    continue;
+                }
+                kept = declarationIn(ast[id].right);
+                break;
+            }
             
-            cout << "\n=== GENERATED ASSEMBLY ===" << endl;
-            generator.printAssembly();
-            generator.saveAssembly(outputFilename);
+            // The branch may or may not run: fold it with the values known
+            // on entry, then (below) forget anything it changed.
+            open.push_back({id, trail.size()});
+            id = ast[id].right;
+        }
+        
+        while (!open.empty()) {
+            OpenIf branch = open.back();
+            open.pop_back();
             
-            return true;
+            vector<pair<SymbolId, int>> branchValues;
+            for (size_t i = branch.mark; i < trail.size(); i++) {
+                branchValues.push_back({trail[i].first, known[trail[i].first]});
+            }
+            for (size_t i = trail.size(); i-- > branch.mark; ) {
+                known[trail[i].first] = trail[i].second;
+            }
+            trail.resize(branch.mark);
+            for (const auto& entry : branchValues) {
+                if (known[entry.first] != entry.second) setKnown(entry.first, UNKNOWN);
+            }
             
-        } catch (const exception& e) {
-            cerr << "Compilation error: " << e.what() << endl;
-            return false;
+            if (kept == INVALID_NODE) continue;
+            ast[branch.id].right = kept;
+            kept = branch.id;
+        }
+        
+        // A declaration takes effect at compile time, whether or not the ifs
+        // around it run, so the merge must not bring back the old variable's value.
+        if (kept != INVALID_NODE) {
+            NodeId declaration = declarationIn(kept);
+            if (declaration != INVALID_NODE) setKnown(ast[declaration].symbol, UNKNOWN);
+        }
+        return kept;
+    }
+    
+public:
+    ConstantFolder(AST& tree, const SymbolTable& symbols) 
+        : ast(tree), known(symbols.size(), UNKNOWN) {}
+    
+    const FoldReport& fold() {
+        // BNE after a condition without a comparison tests the zero flag
+        // left by the last CMP, so then every comparison has to stay.
+        for (NodeId id : ast.statements) {
+            for (; ast[id].type == ASTNodeType::IF_STATEMENT; id = ast[id].right) {
+                const ASTNode& condition = ast[ast[id].left];
+                if (condition.type != ASTNodeType::BINARY_OPERATION || condition.op != BinaryOperator::EQUAL) {
+                    flagsRead = true;
+                }
+            }
         }
+        
+        size_t out = 0;
+        for (NodeId stmt : ast.statements) {
+            NodeId kept = foldStatement(stmt);
+            if (kept != INVALID_NODE) ast.statements[out++] = kept;
+            trail.clear();
+        }
+        ast.statements.resize(out);
+        return report;
     }
 };
 
 // =============================================================================
-// MAIN FUNCTION
+// DEAD STORE ELIMINATION
 // =============================================================================
 
-int main(int argc, char* argv[]) {
-    cout << "SimpleLang Compiler for 8-bit CPU" << endl;
-    cout << "=================================" << endl;
+struct DeadStoreReport {
+    bool applied = false;
+    size_t deadStores = 0;
+    size_t unusedDeclarations = 0;
+};
+
+// Removes assignments whose value is never read and declarations of
+// variables that are never read, walking the statements backwards with the
+// set of live variables; the outputs (see isOutputVariable) are live at the
+// end. A statement inside ifs may not run, so it never kills a variable, and
+// when it is dead the whole chain of ifs goes with it (conditions have no
+// side effects). A declaration starts a new variable: above it, the name
+// refers to the previous variable of that name, live only as an output.
+class DeadStoreEliminator {
+private:
+    AST& ast;
+    const SymbolTable& symbols;
+    vector<bool> output;      // Indexed by SymbolId
+    vector<bool> live;
+    vector<bool> read;        // Read below, since the declaration
+    vector<NodeId> pending;   // Expression walk stack
+    DeadStoreReport report;
     
-    SimpleLangCompiler compiler;
+    template <typename Visit>
+    void forEachIdentifier(NodeId root, Visit visit) {
+        pending.clear();
+        pending.push_back(root);
+        while (!pending.empty()) {
+            const ASTNode& node = ast[pending.back()];
+            pending.pop_back();
+            if (node.type == ASTNodeType::IDENTIFIER) {
+                visit(node.symbol);
+            } else if (node.type == ASTNodeType::BINARY_OPERATION) {
+                pending.push_back(node.left);
+                pending.push_back(node.right);
+            }
+        }
+    }
+    
+    void addUses(NodeId expression) {
+        forEachIdentifier(expression, [&](SymbolId symbol) {
+            live[symbol] = true;
+            read[symbol] = true;
+        });
+    }
+    
+    // Removing code is only safe when it cannot hide a compile error (a
+    // variable used before its declaration) and when every condition sets
+    // the zero flag itself: BNE after a bare expression tests whatever the
+    // last comparison left, which a removed if may have been.
+    bool eligible() {
+        vector<bool> declared(symbols.size(), false);
+        bool allDeclared = true;
+        auto check = [&](SymbolId symbol) {
+            if (!declared[symbol]) allDeclared = false;
+        };
+        for (NodeId id : ast.statements) {
+            while (ast[id].type == ASTNodeType::IF_STATEMENT) {
+                const ASTNode& condition = ast[ast[id].left];
+                if (condition.type != ASTNodeType::BINARY_OPERATION || condition.op != BinaryOperator::EQUAL) {
+                    return false;
+                }
+                forEachIdentifier(ast[id].left, check);
+                id = ast[id].right;
+            }
+            const ASTNode& node = ast[id];
+            if (node.type == ASTNodeType::VARIABLE_DECLARATION) {
+                declared[node.symbol] = true;
+            } else if (node.type == ASTNodeType::ASSIGNMENT) {
+                check(node.symbol);
+                forEachIdentifier(node.left, check);
+            }
+            if (!allDeclared) return false;
+        }
+        return true;
+    }
+    
+    // Returns whether `id` (an if chain or a simple statement) is kept.
+    bool visitStatement(NodeId id) {
+        NodeId inner = id;
+        bool conditional = false;
+        while (ast[inner].type == ASTNodeType::IF_STATEMENT) {
+            conditional = true;
+            inner = ast[inner].right;
+        }
+        
+        const ASTNode& node = ast[inner];
+        if (node.type == ASTNodeType::VARIABLE_DECLARATION) {
+            bool used = read[node.symbol] || output[node.symbol];
+            live[node.symbol] = output[node.symbol];
+            read[node.symbol] = false;
+            if (!used) {
+                report.unusedDeclarations++;
+                return false;
+            }
+        } else if (node.type == ASTNodeType::ASSIGNMENT) {
+            if (!live[node.symbol]) {
+                report.deadStores++;
+                return false;
+            }
+            if (!conditional) live[node.symbol] = false;
+            addUses(node.left);
+        }
+        
+        for (NodeId condition = id; condition != inner; condition = ast[condition].right) {
+            addUses(ast[condition].left);
+        }
+        return true;
+    }
+    
+public:
+    DeadStoreEliminator(AST& tree, const SymbolTable& table, const vector<string>& outputs) 
+        : ast(tree), symbols(table), output(table.size()) {
+        for (SymbolId id = 0; id < table.size(); id++) {
+            output[id] = isOutputVariable(outputs, table.name(id));
+        }
+    }
+    
+    const DeadStoreReport& eliminate() {
+        report = DeadStoreReport();
+        if (!eligible()) return report;
+        report.applied = true;
+        
+        live = output;
+        read.assign(symbols.size(), false);
+        size_t out = ast.statements.size();
+        for (size_t i = ast.statements.size(); i-- > 0; ) {
+            NodeId stmt = ast.statements[i];
+            if (visitStatement(stmt)) ast.statements[--out] = stmt;
+        }
+        ast.statements.erase(ast.statements.begin(), ast.statements.begin() + out);
+        return report;
+    }
+};
+
+// =============================================================================
+// INSTRUCTION IR
+// =============================================================================
+
+// The code generator emits structured instructions rather than text, so later
+// passes can inspect and rewrite them; text is only produced when printing.
+// Machine opcodes come first and are numbered densely (the simulator's
+// dispatch table depends on it); pseudo-instructions carry the comments,
+// labels and spacing of the listing and occupy no space on the target.
+enum class Opcode : uint8_t {
+    LDA_IMM,    // operand: immediate value
+    LDA_MEM,    // operand: address
+    STA,        // operand: address
+    PHA,
+    PLA,
+    TAX,
+    ADC_X,
+    SBC_X,
+    CMP_X,
+    BNE,        // operand: label number
+    HLT,
+    
+    LABEL,          // operand: label number
+    DECLARE,        // "; Declare variable" note; operand: address
+    ASSIGN_NOTE,    // "; Assignment" note
+    IF_NOTE,        // "; If statement" note
+    BLANK           // Empty line
+};
+
+const SymbolId NO_SYMBOL = UINT32_MAX;
+
+struct Instruction {
+    Opcode op;
+    int32_t operand;
+    SymbolId symbol;   // Variable named in the comment, or NO_SYMBOL
+};
+
+inline bool isMachineInstruction(Opcode op) {
+    return op < Opcode::LABEL;
+}
+
+size_t countMachineInstructions(const vector<Instruction>& code) {
+    size_t count = 0;
+    for (const Instruction& inst : code) {
+        if (isMachineInstruction(inst.op)) count++;
+    }
+    return count;
+}
+
+// Estimated cycle counts per opcode (6502-style timings for the equivalent
+// addressing modes, taken branches assumed), used to report optimization gains.
+inline int instructionCycles(Opcode op) {
+    switch (op) {
+        case Opcode::LDA_IMM: return 2;
+        case Opcode::LDA_MEM: return 3;
+        case Opcode::STA:     return 3;
+        case Opcode::PHA:     return 3;
+        case Opcode::PLA:     return 4;
+        case Opcode::TAX:     return 2;
+        case Opcode::ADC_X:   return 2;
+        case Opcode::SBC_X:   return 2;
+        case Opcode::CMP_X:   return 2;
+        case Opcode::BNE:     return 3;
+        case Opcode::HLT:     return 1;
+        default:              return 0;
+    }
+}
+
+// Formats instructions straight into one growable byte buffer (numbers via
+// to_chars, no temporary strings) so a listing can be written with a single
+// write call. Comments, notes and spacing can be left out for compact output.
+class AssemblyEmitter {
+private:
+    string buffer;
+    bool comments;
+    
+    void append(string_view text) {
+        buffer.append(text);
+    }
+    
+    void appendNumber(int32_t value) {
+        char digits[12];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, result.ptr - digits);
+    }
+    
+    void appendComment(string_view comment) {
+        if (comments) append(comment);
+        buffer.push_back('\n');
+    }
+    
+    void appendName(SymbolId symbol, const SymbolTable& symbols) {
+        if (comments && symbol != NO_SYMBOL) append(symbols.name(symbol));
+    }
+    
+public:
+    AssemblyEmitter(bool withComments = true) : comments(withComments) {}
+    
+    void setComments(bool withComments) {
+        comments = withComments;
+    }
+    
+    void emit(const vector<Instruction>& code, const SymbolTable& symbols) {
+        buffer.clear();
+        buffer.reserve(code.size() * (comments ? 40 : 12) + 64);
+        
+        if (comments) {
+            append("; SimpleLang Compiler Output\n");
+            append("; Generated Assembly for 8-bit CPU\n\n");
+        }
+        
+        for (const Instruction& inst : code) {
+            switch (inst.op) {
+                case Opcode::LDA_IMM:
+                    append("    LDA #");
+                    appendNumber(inst.operand);
+                    appendComment("  ; Load immediate value");
+                    break;
+                case Opcode::LDA_MEM:
+                    append("    LDA $");
+                    appendNumber(inst.operand);
+                    if (comments) append("  ; Load variable ");
+                    appendName(inst.symbol, symbols);
+                    buffer.push_back('\n');
+                    break;
+                case Opcode::STA:
+                    append("    STA $");
+                    appendNumber(inst.operand);
+                    if (comments) append("  ; Store to variable ");
+                    appendName(inst.symbol, symbols);
+                    buffer.push_back('\n');
+                    break;
+                case Opcode::PHA:   append("    PHA"); appendComment("              ; Push left operand"); break;
+                case Opcode::PLA:   append("    PLA"); appendComment("              ; Pop left operand"); break;
+                case Opcode::TAX:   append("    TAX"); appendComment("              ; Transfer A to X"); break;
+                case Opcode::ADC_X: append("    ADC X"); appendComment("            ; Add X to A"); break;
+                case Opcode::SBC_X: append("    SBC X"); appendComment("            ; Subtract X from A"); break;
+                case Opcode::CMP_X: append("    CMP X"); appendComment("            ; Compare A with X"); break;
+                case Opcode::HLT:   append("    HLT"); appendComment("              ; Halt the processor"); break;
+                case Opcode::BNE:
+                    append("    BNE L");
+                    appendNumber(inst.operand);
+                    appendComment("    ; Branch if not equal (condition false)");
+                    break;
+                case Opcode::LABEL:
+                    buffer.push_back('L');
+                    appendNumber(inst.operand);
+                    append(":\n");
+                    break;
+                case Opcode::DECLARE:
+                    if (!comments) break;
+                    append("; Declare variable: ");
+                    appendName(inst.symbol, symbols);
+                    append(" at address $");
+                    appendNumber(inst.operand);
+                    buffer.push_back('\n');
+                    break;
+                case Opcode::ASSIGN_NOTE:
+                    if (!comments) break;
+                    append("; Assignment: ");
+                    appendName(inst.symbol, symbols);
+                    buffer.push_back('\n');
+                    break;
+                case Opcode::IF_NOTE:
+                    if (comments) append("; If statement\n");
+                    break;
+                case Opcode::BLANK:
+                    if (comments) buffer.push_back('\n');
+                    break;
+            }
+        }
+    }
+    
+    const string& text() const { return buffer; }
+    
+    bool writeToFile(const string& filename) const {
+        return writeFile(filename, buffer);
+    }
+};
+
+// Parses an assembly listing in the format AssemblyEmitter produces back into
+// instructions. Variable names are recovered from declaration notes; label
+// names are renumbered densely in order of first appearance.
+vector<Instruction> readAssembly(const vector<string>& lines, SymbolTable& symbols) {
+    static const string declarePrefix = "; Declare variable: ";
+    
+    auto trim = [](const string& text) {
+        size_t begin = text.find_first_not_of(" \t\r");
+        if (begin == string::npos) return string();
+        size_t end = text.find_last_not_of(" \t\r");
+        return text.substr(begin, end - begin + 1);
+    };
+    
+    auto parseOperand = [](const string& text, size_t lineNumber) {
+        char* end = nullptr;
+        long value = strtol(text.c_str(), &end, 0);
+        if (text.empty() || *end != '\0') {
+            throw runtime_error("Bad operand '" + text + "' on line " + to_string(lineNumber));
+        }
+        return (int32_t)value;
+    };
+    
+    unordered_map<string, int32_t> labelNumbers;
+    auto labelNumber = [&](const string& name) {
+        auto it = labelNumbers.find(name);
+        if (it != labelNumbers.end()) return it->second;
+        int32_t number = (int32_t)labelNumbers.size();
+        labelNumbers.emplace(name, number);
+        return number;
+    };
+    
+    vector<Instruction> code;
+    for (size_t i = 0; i < lines.size(); i++) {
+        const string& raw = lines[i];
+        
+        if (raw.compare(0, declarePrefix.size(), declarePrefix) == 0) {
+            size_t at = raw.find(" at address $", declarePrefix.size());
+            if (at != string::npos) {
+                SymbolId symbol = symbols.intern(raw.substr(declarePrefix.size(), at - declarePrefix.size()));
+                code.push_back({Opcode::DECLARE, parseOperand(trim(raw.substr(at + 13)), i + 1), symbol});
+            }
+            continue;
+        }
+        
+        string line = trim(raw.substr(0, raw.find(';')));
+        if (line.empty()) continue;
+        
+        if (line.back() == ':') {
+            code.push_back({Opcode::LABEL, labelNumber(line.substr(0, line.size() - 1)), NO_SYMBOL});
+            continue;
+        }
+        
+        size_t space = line.find_first_of(" \t");
+        string mnemonic = line.substr(0, space);
+        string operand = space == string::npos ? "" : trim(line.substr(space));
+        
+        Instruction inst = {Opcode::HLT, 0, NO_SYMBOL};
+        if (mnemonic == "LDA" && !operand.empty() && operand[0] == '#') {
+            inst = {Opcode::LDA_IMM, parseOperand(operand.substr(1), i + 1), NO_SYMBOL};
+        } else if (mnemonic == "LDA" && !operand.empty() && operand[0] == '$') {
+            inst = {Opcode::LDA_MEM, parseOperand(operand.substr(1), i + 1), NO_SYMBOL};
+        } else if (mnemonic == "STA" && !operand.empty() && operand[0] == '$') {
+            inst = {Opcode::STA, parseOperand(operand.substr(1), i + 1), NO_SYMBOL};
+        } else if (mnemonic == "PHA" && operand.empty()) {
+            inst.op = Opcode::PHA;
+        } else if (mnemonic == "PLA" && operand.empty()) {
+            inst.op = Opcode::PLA;
+        } else if (mnemonic == "TAX" && operand.empty()) {
+            inst.op = Opcode::TAX;
+        } else if (mnemonic == "ADC" && operand == "X") {
+            inst.op = Opcode::ADC_X;
+        } else if (mnemonic == "SBC" && operand == "X") {
+            inst.op = Opcode::SBC_X;
+        } else if (mnemonic == "CMP" && operand == "X") {
+            inst.op = Opcode::CMP_X;
+        } else if (mnemonic == "BNE" && !operand.empty()) {
+            inst = {Opcode::BNE, labelNumber(operand), NO_SYMBOL};
+        } else if (mnemonic == "HLT" && operand.empty()) {
+            inst.op = Opcode::HLT;
+        } else {
+            throw runtime_error("Unsupported instruction '" + line + "' on line " + to_string(i + 1));
+        }
+        code.push_back(inst);
+    }
+    return code;
+}
+
+// =============================================================================
+// BINARY IMAGE
+// =============================================================================
+
+// The target's memory as one 256-byte image: code from $00, data (the
+// variables, initially zero) from MEMORY_START. Each instruction is an
+// opcode byte, followed by one operand byte for immediates, addresses and
+// branch targets (the address of the label). HLT encodes as $00, so running
+// into unused memory halts. The opcode numbering below is this compiler's
+// own, not the target CPU's: the image is a private format that
+// decodeImage reads back for --simulate.
+const size_t IMAGE_SIZE = 256;
+const size_t CODE_LIMIT = 0x80;   // == MEMORY_START
+
+inline uint8_t imageOpcode(Opcode op) {
+    switch (op) {
+        case Opcode::HLT:     return 0x00;
+        case Opcode::LDA_IMM: return 0x01;
+        case Opcode::LDA_MEM: return 0x02;
+        case Opcode::STA:     return 0x03;
+        case Opcode::PHA:     return 0x04;
+        case Opcode::PLA:     return 0x05;
+        case Opcode::TAX:     return 0x06;
+        case Opcode::ADC_X:   return 0x07;
+        case Opcode::SBC_X:   return 0x08;
+        case Opcode::CMP_X:   return 0x09;
+        case Opcode::BNE:     return 0x0A;
+        default:              return 0xFF;
+    }
+}
+
+inline bool hasOperandByte(Opcode op) {
+    return op == Opcode::LDA_IMM || op == Opcode::LDA_MEM || op == Opcode::STA || op == Opcode::BNE;
+}
+
+// Exact size of the encoded program, whether or not it fits.
+size_t codeBytes(const vector<Instruction>& code) {
+    size_t bytes = 0;
+    for (const Instruction& inst : code) {
+        if (isMachineInstruction(inst.op)) bytes += hasOperandByte(inst.op) ? 2 : 1;
+    }
+    return bytes;
+}
+
+// Throws if `size` bytes of code would run into the data region.
+void checkCodeFits(size_t size) {
+    if (size > CODE_LIMIT) {
+        throw runtime_error("Code is " + to_string(size) + " bytes, but only " + 
+                            to_string(CODE_LIMIT) + " fit below the data region");
+    }
+}
+
+// Encodes a program with allocated addresses in two passes: label
+// addresses first, then the bytes with branch targets resolved.
+array<uint8_t, IMAGE_SIZE> encodeImage(const vector<Instruction>& code) {
+    checkCodeFits(codeBytes(code));
+    
+    vector<int> labelAddresses;
+    size_t address = 0;
+    for (const Instruction& inst : code) {
+        if (inst.op == Opcode::LABEL) {
+            if ((size_t)inst.operand >= labelAddresses.size()) labelAddresses.resize(inst.operand + 1, -1);
+            labelAddresses[inst.operand] = (int)address;
+        } else if (isMachineInstruction(inst.op)) {
+            address += hasOperandByte(inst.op) ? 2 : 1;
+        }
+    }
+    
+    array<uint8_t, IMAGE_SIZE> image{};
+    address = 0;
+    for (const Instruction& inst : code) {
+        if (!isMachineInstruction(inst.op)) continue;
+        image[address++] = imageOpcode(inst.op);
+        if (!hasOperandByte(inst.op)) continue;
+        int32_t operand = inst.operand;
+        if (inst.op == Opcode::BNE) {
+            if ((size_t)operand >= labelAddresses.size() || labelAddresses[operand] < 0) {
+                throw runtime_error("Undefined label L" + to_string(operand));
+            }
+            operand = labelAddresses[operand];
+        } else if (inst.op != Opcode::LDA_IMM && (operand < (int32_t)CODE_LIMIT || operand >= (int32_t)IMAGE_SIZE)) {
+            throw runtime_error("Address $" + to_string(operand) + " is outside the data region");
+        }
+        image[address++] = (uint8_t)(operand & 0xFF);
+    }
+    return image;
+}
+
+// Decodes the code region of an image back into instructions, with a label
+// at every branch target, so an image can be run on the simulator.
+vector<Instruction> decodeImage(const uint8_t* image, size_t size) {
+    size = min(size, CODE_LIMIT);
+    vector<Instruction> decoded;
+    vector<size_t> addresses;   // Of each entry in `decoded`
+    vector<bool> isTarget(CODE_LIMIT + 1, false);
+    
+    for (size_t address = 0; address < size; ) {
+        Opcode op = Opcode::LABEL;
+        for (uint8_t candidate = 0; candidate < (uint8_t)Opcode::LABEL; candidate++) {
+            if (imageOpcode((Opcode)candidate) == image[address]) op = (Opcode)candidate;
+        }
+        if (op == Opcode::LABEL) {
+            throw runtime_error("Unknown opcode $" + to_string(image[address]) + 
+                                " at address " + to_string(address));
+        }
+        int32_t operand = 0;
+        if (hasOperandByte(op)) {
+            if (address + 1 >= size) {
+                throw runtime_error("Truncated instruction at address " + to_string(address));
+            }
+            operand = image[address + 1];
+            if (op == Opcode::BNE) {
+                if ((size_t)operand > size) {
+                    throw runtime_error("Branch outside the code at address " + to_string(address));
+                }
+                isTarget[operand] = true;
+            }
+        }
+        decoded.push_back({op, operand, NO_SYMBOL});
+        addresses.push_back(address);
+        address += hasOperandByte(op) ? 2 : 1;
+    }
+    
+    // Labels are numbered by address
+    vector<Instruction> code;
+    for (size_t i = 0; i < decoded.size(); i++) {
+        if (isTarget[addresses[i]]) code.push_back({Opcode::LABEL, (int32_t)addresses[i], NO_SYMBOL});
+        code.push_back(decoded[i]);
+    }
+    if (isTarget[size]) code.push_back({Opcode::LABEL, (int32_t)size, NO_SYMBOL});
+    return code;
+}
+
+// =============================================================================
+// CODE GENERATOR CLASS
+// =============================================================================
+
+class CodeGenerator {
+private:
+    const AST* ast;
+    const SymbolTable& symbols;
+    vector<int> symbolAddresses;   // Indexed by SymbolId, -1 while undeclared
+    int nextAddress;               // Unbounded; MemoryAllocator assigns the real addresses
+    vector<Instruction> code;
+    int labelCounter;
+    bool registerExpressions;
+    vector<int> openLabels;   // End labels of the ifs enclosing the current statement
+    
+    int generateLabel() {
+        return labelCounter++;
+    }
+    
+    int addressOf(SymbolId symbol) {
+        int address = symbolAddresses[symbol];
+        if (address < 0) {
+            throw runtime_error("Undefined variable: " + symbols.name(symbol));
+        }
+        return address;
+    }
+    
+    void emit(Opcode op, int32_t operand = 0, SymbolId symbol = NO_SYMBOL) {
+        code.push_back({op, operand, symbol});
+    }
+    
+    static Opcode combineOpcode(BinaryOperator op) {
+        switch (op) {
+            case BinaryOperator::ADD:      return Opcode::ADC_X;
+            case BinaryOperator::SUBTRACT: return Opcode::SBC_X;
+            case BinaryOperator::EQUAL:    return Opcode::CMP_X;
+        }
+        return Opcode::ADC_X;
+    }
+    
+    bool isLeaf(NodeId id) const {
+        ASTNodeType type = (*ast)[id].type;
+        return type == ASTNodeType::NUMBER || type == ASTNodeType::IDENTIFIER;
+    }
+    
+    void generateLeaf(NodeId id) {
+        const ASTNode& node = (*ast)[id];
+        if (node.type == ASTNodeType::NUMBER) {
+            emit(Opcode::LDA_IMM, node.value);
+        } else {
+            emit(Opcode::LDA_MEM, addressOf(node.symbol), node.symbol);
+        }
+    }
+    
+    // Expressions are lowered with an explicit work stack: each entry either
+    // generates a subexpression or emits one instruction. A binary operation
+    // expands into its whole sequence (operands interleaved with the
+    // instructions between them), pushed in reverse so it runs in order.
+    struct Work {
+        NodeId expression;         // INVALID_NODE: emit `instruction` instead
+        Instruction instruction;
+    };
+    vector<Work> work;
+    
+    void pushExpression(NodeId id) {
+        work.push_back({id, {}});
+    }
+    
+    void pushInstruction(Opcode op, int32_t operand = 0) {
+        work.push_back({INVALID_NODE, {op, operand, NO_SYMBOL}});
+    }
+    
+    // Sethi-Ullman style lowering for a machine with one scratch register:
+    // a leaf can be loaded into A at any time without disturbing X, so the
+    // stack is only needed when both operands are compound, or when a
+    // compound left operand is reduced by a variable (SBC is not commutative).
+    // Pushes the reversed sequence and returns true, or returns false when
+    // the operands need the stack-based sequence.
+    bool pushRegisterOperation(const ASTNode& node) {
+        bool leftLeaf = isLeaf(node.left);
+        bool rightLeaf = isLeaf(node.right);
+        
+        if (leftLeaf) {
+            // X <- right, A <- left
+            pushInstruction(combineOpcode(node.op));
+            pushExpression(node.left);
+            pushInstruction(Opcode::TAX);
+            pushExpression(node.right);
+            return true;
+        }
+        
+        if (!rightLeaf) return false;
+        
+        const ASTNode& right = (*ast)[node.right];
+        if (node.op != BinaryOperator::SUBTRACT) {
+            // Commutative: X <- left, A <- right
+            pushInstruction(combineOpcode(node.op));
+            pushExpression(node.right);
+            pushInstruction(Opcode::TAX);
+            pushExpression(node.left);
+            return true;
+        }
+        
+        if (right.type == ASTNodeType::NUMBER) {
+            // left - n == n' + left where n' is the two's complement of n
+            pushInstruction(Opcode::ADC_X);
+            pushInstruction(Opcode::LDA_IMM, (-right.value) & 0xFF);
+            pushInstruction(Opcode::TAX);
+            pushExpression(node.left);
+            return true;
+        }
+        
+        return false;
+    }
+    
+    void generateExpression(NodeId root) {
+        work.clear();   // Whatever an earlier error left behind
+        pushExpression(root);
+        while (!work.empty()) {
+            Work item = work.back();
+            work.pop_back();
+            if (item.expression == INVALID_NODE) {
+                code.push_back(item.instruction);
+                continue;
+            }
+            
+            const ASTNode& node = (*ast)[item.expression];
+            switch (node.type) {
+                case ASTNodeType::NUMBER:
+                case ASTNodeType::IDENTIFIER: {
+                    generateLeaf(item.expression);
+                    break;
+                }
+                
+                case ASTNodeType::BINARY_OPERATION: {
+                    if (registerExpressions && pushRegisterOperation(node)) break;
+                    
+                    // Evaluate left into A, park it on the stack while the right
+                    // operand is evaluated and moved to X, then combine.
+                    pushInstruction(combineOpcode(node.op));
+                    pushInstruction(Opcode::PLA);
+                    pushInstruction(Opcode::TAX);
+                    pushExpression(node.right);
+                    pushInstruction(Opcode::PHA);
+                    pushExpression(node.left);
+                    break;
+                }
+                
+                default:
+                    throw runtime_error("Unsupported expression type in code generation");
+            }
+        }
+    }
+    
+public:
+    CodeGenerator(const SymbolTable& table, bool useRegisters = false) 
+        : ast(nullptr), symbols(table), nextAddress(0x80), labelCounter(0), registerExpressions(useRegisters) {}
+    
+    void generateCode(const AST& program) {
+        begin(program);
+        for (NodeId stmt : program.statements) {
+            generateStatement(stmt);
+        }
+        finish();
+    }
+    
+    // Statement-at-a-time generation: begin(), then any mix of
+    // generateStatement() and appendBlock(), then finish().
+    void begin(const AST& program) {
+        ast = &program;
+        symbolAddresses.assign(symbols.size(), -1);
+    }
+    
+    void finish() {
+        // Add program termination
+        emit(Opcode::BLANK);
+        emit(Opcode::HLT);
+    }
+    
+    // Appends code generated earlier for one statement, with memory operands
+    // still carrying their symbols and labels numbered from 0. Addresses and
+    // labels are re-linked exactly as generateStatement would assign them.
+    void appendBlock(const Instruction* block, size_t count, int labels) {
+        int labelBase = labelCounter;
+        for (size_t i = 0; i < count; i++) {
+            Instruction instruction = block[i];
+            switch (instruction.op) {
+                case Opcode::DECLARE:
+                    instruction.operand = symbolAddresses[instruction.symbol] = nextAddress++;
+                    break;
+                case Opcode::LDA_MEM:
+                case Opcode::STA:
+                    instruction.operand = addressOf(instruction.symbol);
+                    break;
+                case Opcode::LABEL:
+                case Opcode::BNE:
+                    instruction.operand += labelBase;
+                    break;
+                default:
+                    break;
+            }
+            code.push_back(instruction);
+        }
+        labelCounter += labels;
+    }
+    
+    int getLabelCount() const {
+        return labelCounter;
+    }
+    
+    void generateStatement(NodeId id) {
+        // Nested ifs are a chain (each body is one statement): open them all,
+        // generate the innermost statement, then close them in reverse.
+        size_t labelBase = openLabels.size();
+        while ((*ast)[id].type == ASTNodeType::IF_STATEMENT) {
+            const ASTNode& node = (*ast)[id];
+            int endLabel = generateLabel();
+            
+            emit(Opcode::IF_NOTE);
+            generateExpression(node.left);
+            emit(Opcode::BNE, endLabel);
+            
+            openLabels.push_back(endLabel);
+            id = node.right;
+        }
+        
+        const ASTNode& node = (*ast)[id];
+        switch (node.type) {
+            case ASTNodeType::VARIABLE_DECLARATION: {
+                int address = symbolAddresses[node.symbol] = nextAddress++;
+                emit(Opcode::DECLARE, address, node.symbol);
+                break;
+            }
+            
+            case ASTNodeType::ASSIGNMENT: {
+                emit(Opcode::ASSIGN_NOTE, 0, node.symbol);
+                generateExpression(node.left);
+                emit(Opcode::STA, addressOf(node.symbol), node.symbol);
+                break;
+            }
+            
+            default:
+                throw runtime_error("Unsupported statement type in code generation");
+        }
+        emit(Opcode::BLANK);
+        
+        while (openLabels.size() > labelBase) {
+            emit(Opcode::LABEL, openLabels.back());
+            emit(Opcode::BLANK);
+            openLabels.pop_back();
+        }
+    }
+    
+    vector<Instruction>& getCode() {
+        return code;
+    }
+    
+    const vector<Instruction>& getCode() const {
+        return code;
+    }
+    
+    // Empties the generator for another program, keeping its buffers.
+    void reset(bool useRegisters) {
+        code.clear();
+        openLabels.clear();
+        nextAddress = 0x80;
+        labelCounter = 0;
+        registerExpressions = useRegisters;
+    }
+};
+
+// =============================================================================
+// MEMORY ALLOCATION
+// =============================================================================
+
+// Variables live in the upper half of the address space, $80-$FF.
+const int MEMORY_START = 0x80;
+const int MEMORY_SIZE = 0x80;
+
+struct AllocationReport {
+    size_t variables = 0;   // Declarations
+    size_t shared = 0;      // Declarations placed at an address already in use
+    size_t bytes = 0;       // Peak footprint: distinct addresses used
+};
+
+// Gives every declared variable its real address. The code generator numbers
+// declarations consecutively from $80 with no upper bound; this pass works
+// out each variable's live interval over the final instruction stream and
+// lets variables whose intervals are disjoint share a byte.
+//
+// Branches only go forward, to the end of an if (or, once threaded, of a
+// later one), so an interval can be the span from the first access to the
+// last one. A variable read on some path before any write still holds its
+// initial zero, and an output must survive to the end, so those intervals
+// are stretched to the start and the end of the program. Addresses are
+// handed out first-fit in declaration order: when every variable is an
+// output (the default) nothing can share and the layout is the generator's
+// own.
+class MemoryAllocator {
+private:
+    struct Variable {
+        SymbolId symbol = NO_SYMBOL;
+        bool output = false;
+        bool exposed = false;   // Read before being written on some path
+        int firstAccess = -1;
+        int lastAccess = -1;
+        int address = MEMORY_START;
+    };
+    
+    vector<Variable> variables;   // Indexed by generated address - MEMORY_START
+    AllocationReport report;
+    
+    // Scratch space, kept between calls
+    vector<bool> written;
+    vector<size_t> trail;                     // Variables marked in `written`, in order
+    vector<pair<int32_t, size_t>> regions;    // Open ifs: end label, trail size at entry
+    vector<uint32_t> pending;                 // Per label: open regions ending there
+    vector<vector<pair<int, int>>> slots;     // Per address: disjoint (start, end), sorted
+    size_t slotCount = 0;
+    
+    Variable* variableAt(int32_t address) {
+        size_t index = (size_t)(address - MEMORY_START);
+        return address >= MEMORY_START && index < variables.size() ? &variables[index] : nullptr;
+    }
+    
+    // Records the accesses of every variable, and which reads can see a value
+    // that no write put there: a write inside an if only covers the rest of
+    // that if's body, so it is undone at the if's end label.
+    void scan(const vector<Instruction>& code, const SymbolTable& symbols, 
+              const vector<string>& outputs) {
+        written.clear();
+        trail.clear();
+        regions.clear();
+        pending.clear();
+        for (size_t i = 0; i < code.size(); i++) {
+            const Instruction& inst = code[i];
+            switch (inst.op) {
+                case Opcode::DECLARE: {
+                    size_t index = (size_t)(inst.operand - MEMORY_START);
+                    if (index >= variables.size()) {
+                        variables.resize(index + 1);
+                        written.resize(index + 1, false);
+                    }
+                    variables[index].symbol = inst.symbol;
+                    variables[index].output = isOutputVariable(outputs, symbols.name(inst.symbol));
+                    break;
+                }
+                case Opcode::LDA_MEM:
+                case Opcode::STA: {
+                    Variable* variable = variableAt(inst.operand);
+                    if (!variable) break;
+                    size_t index = variable - variables.data();
+                    if (variable->firstAccess < 0) variable->firstAccess = (int)i;
+                    variable->lastAccess = (int)i;
+                    if (written[index]) break;
+                    if (inst.op == Opcode::LDA_MEM) {
+                        variable->exposed = true;
+                    } else {
+                        written[index] = true;
+                        trail.push_back(index);
+                    }
+                    break;
+                }
+                case Opcode::BNE:
+                    regions.push_back({inst.operand, trail.size()});
+                    if ((size_t)inst.operand >= pending.size()) pending.resize(inst.operand + 1, 0);
+                    pending[inst.operand]++;
+                    break;
+                case Opcode::LABEL: {
+                    if ((size_t)inst.operand >= pending.size() || pending[inst.operand] == 0) break;
+                    // Close every region ending here, back to the outermost
+                    size_t outermost = regions.size();
+                    for (uint32_t found = 0; found < pending[inst.operand]; ) {
+                        if (regions[--outermost].first == inst.operand) found++;
+                    }
+                    pending[inst.operand] = 0;
+                    size_t entry = regions[outermost].second;
+                    for (size_t t = entry; t < trail.size(); t++) {
+                        written[trail[t]] = false;
+                    }
+                    trail.resize(entry);
+                    // A branch threaded past this label keeps its region
+                    // open, conservatively as if it had been entered here
+                    size_t kept = outermost;
+                    for (size_t r = outermost + 1; r < regions.size(); r++) {
+                        if (regions[r].first != inst.operand) regions[kept++] = {regions[r].first, entry};
+                    }
+                    regions.resize(kept);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        
+        // Outputs are read once more when the program ends
+        for (size_t index = 0; index < variables.size(); index++) {
+            Variable& variable = variables[index];
+            if (!variable.output) continue;
+            if (!written[index]) variable.exposed = true;
+            variable.lastAccess = (int)code.size();
+        }
+    }
+    
+    void assignAddresses(const SymbolTable& symbols) {
+        for (auto& slot : slots) {
+            slot.clear();
+        }
+        slotCount = 0;
+        for (Variable& variable : variables) {
+            if (variable.symbol == NO_SYMBOL) continue;
+            report.variables++;
+            if (variable.lastAccess < 0) continue;   // Never used: any address will do
+            
+            int start = variable.exposed ? 0 : variable.firstAccess;
+            int end = variable.lastAccess;
+            size_t slot = 0;
+            auto after = [&](size_t index) {
+                return upper_bound(slots[index].begin(), slots[index].end(), make_pair(end, INT_MAX));
+            };
+            for (; slot < slotCount; slot++) {
+                auto next = after(slot);
+                if (next == slots[slot].begin() || prev(next)->second < start) break;
+            }
+            if (slot == slotCount) {
+                if (slot == (size_t)MEMORY_SIZE) {
+                    throw runtime_error("Out of memory: variable " + symbols.name(variable.symbol) + 
+                                        " needs an address but all " + to_string(MEMORY_SIZE) + 
+                                        " bytes of data memory hold live variables");
+                }
+                if (slotCount == slots.size()) slots.emplace_back();
+                slotCount++;
+            } else {
+                report.shared++;
+            }
+            slots[slot].insert(after(slot), {start, end});
+            variable.address = MEMORY_START + (int)slot;
+        }
+        report.bytes = slotCount;
+    }
+    
+public:
+    // Rewrites the addresses in `code`. Throws when more variables are live
+    // at once than there are bytes of memory.
+    const AllocationReport& allocate(vector<Instruction>& code, const SymbolTable& symbols, 
+                                     const vector<string>& outputs) {
+        report = AllocationReport();
+        variables.clear();
+        scan(code, symbols, outputs);
+        assignAddresses(symbols);
+        
+        for (Instruction& inst : code) {
+            if (inst.op != Opcode::DECLARE && inst.op != Opcode::LDA_MEM && inst.op != Opcode::STA) continue;
+            if (Variable* variable = variableAt(inst.operand)) inst.operand = variable->address;
+        }
+        return report;
+    }
+};
+
+// =============================================================================
+// PEEPHOLE OPTIMIZER
+// =============================================================================
+
+struct PeepholeOptions {
+    bool pushPop = false;       // Drop PHA/PLA pairs that preserve nothing
+    bool deadLoads = false;     // Drop loads whose value is overwritten unused
+    bool storeReload = false;   // Drop LDA $x after STA $x and STA $x after LDA $x
+    
+    bool any() const { return pushPop || deadLoads || storeReload; }
+};
+
+struct PeepholeReport {
+    size_t pushPopPairs = 0;
+    size_t deadLoads = 0;
+    size_t storeReloads = 0;
+    size_t instructionsBefore = 0;
+    size_t instructionsAfter = 0;
+    long cyclesBefore = 0;
+    long cyclesAfter = 0;
+};
+
+// Rewrites the instruction stream within straight-line windows. Labels and
+// branches end a window; notes and blank lines are transparent. Rules run to
+// a fixed point because one rewrite often exposes another (a rematerialized
+// pop leaves the original load dead, for example).
+class PeepholeOptimizer {
+private:
+    PeepholeOptions options;
+    PeepholeReport report;
+    vector<Instruction>* code;
+    vector<bool> removed;
+    
+    static bool writesA(Opcode op) {
+        return op == Opcode::LDA_IMM || op == Opcode::LDA_MEM || op == Opcode::PLA ||
+               op == Opcode::ADC_X || op == Opcode::SBC_X;
+    }
+    
+    static bool isLoad(Opcode op) {
+        return op == Opcode::LDA_IMM || op == Opcode::LDA_MEM;
+    }
+    
+    // Next live machine instruction or label after i, or code size.
+    size_t nextLive(size_t i) const {
+        for (i++; i < code->size(); i++) {
+            if (removed[i]) continue;
+            Opcode op = (*code)[i].op;
+            if (isMachineInstruction(op) || op == Opcode::LABEL) return i;
+        }
+        return code->size();
+    }
+    
+    size_t previousLive(size_t i) const {
+        while (i-- > 0) {
+            if (removed[i]) continue;
+            Opcode op = (*code)[i].op;
+            if (isMachineInstruction(op) || op == Opcode::LABEL) return i;
+        }
+        return code->size();
+    }
+    
+    bool remove(size_t i) {
+        removed[i] = true;
+        return true;
+    }
+    
+    // PHA ... PLA where nothing in between touches A or the stack is a no-op.
+    // If A is clobbered in between but is known to equal an immediate or a
+    // memory location left untouched, the PLA is replaced by a reload instead.
+    bool tryPushPop(size_t push) {
+        vector<Instruction>& insts = *code;
+        bool clobbersA = false;
+        bool sourceWritten = false;
+        size_t before = previousLive(push);
+        
+        Instruction reload = {Opcode::LABEL, 0, NO_SYMBOL};
+        bool haveSource = false;
+        if (before < insts.size() && (isLoad(insts[before].op) || insts[before].op == Opcode::STA)) {
+            reload = insts[before];
+            if (reload.op == Opcode::STA) reload.op = Opcode::LDA_MEM;
+            haveSource = true;
+        }
+        
+        for (size_t i = nextLive(push); i < insts.size(); i = nextLive(i)) {
+            Opcode op = insts[i].op;
+            if (op == Opcode::PLA) {
+                if (!clobbersA) {
+                    remove(push);
+                    return remove(i);
+                }
+                if (haveSource && !sourceWritten) {
+                    insts[i] = reload;
+                    return remove(push);
+                }
+                return false;
+            }
+            if (op == Opcode::PHA || op == Opcode::LABEL || op == Opcode::BNE || op == Opcode::HLT) {
+                return false;
+            }
+            if (writesA(op)) clobbersA = true;
+            if (op == Opcode::STA && haveSource && reload.op == Opcode::LDA_MEM && 
+                insts[i].operand == reload.operand) {
+                sourceWritten = true;
+            }
+        }
+        return false;
+    }
+    
+    bool runPass() {
+        vector<Instruction>& insts = *code;
+        bool changed = false;
+        
+        for (size_t i = 0; i < insts.size(); i++) {
+            if (removed[i]) continue;
+            Opcode op = insts[i].op;
+            size_t next = nextLive(i);
+            Opcode nextOp = next < insts.size() ? insts[next].op : Opcode::LABEL;
+            
+            if (options.deadLoads && isLoad(op) && 
+                (isLoad(nextOp) || nextOp == Opcode::PLA)) {
+                changed = remove(i);
+                report.deadLoads++;
+            } else if (options.storeReload && op == Opcode::STA && nextOp == Opcode::LDA_MEM &&
+                       insts[next].operand == insts[i].operand) {
+                changed = remove(next);
+                report.storeReloads++;
+            } else if (options.storeReload && op == Opcode::LDA_MEM && nextOp == Opcode::STA &&
+                       insts[next].operand == insts[i].operand) {
+                changed = remove(next);
+                report.storeReloads++;
+            } else if (options.pushPop && op == Opcode::PHA && tryPushPop(i)) {
+                changed = true;
+                report.pushPopPairs++;
+            }
+        }
+        return changed;
+    }
+    
+    static void measure(const vector<Instruction>& insts, size_t& count, long& cycles) {
+        count = 0;
+        cycles = 0;
+        for (const Instruction& inst : insts) {
+            if (!isMachineInstruction(inst.op)) continue;
+            count++;
+            cycles += instructionCycles(inst.op);
+        }
+    }
+    
+public:
+    PeepholeOptimizer(const PeepholeOptions& opts) : options(opts), code(nullptr) {}
+    
+    const PeepholeReport& optimize(vector<Instruction>& insts) {
+        report = PeepholeReport();
+        code = &insts;
+        measure(insts, report.instructionsBefore, report.cyclesBefore);
+        
+        bool changed = true;
+        while (changed) {
+            removed.assign(insts.size(), false);
+            changed = runPass();
+            
+            size_t out = 0;
+            for (size_t i = 0; i < insts.size(); i++) {
+                if (!removed[i]) insts[out++] = insts[i];
+            }
+            insts.resize(out);
+        }
+        
+        measure(insts, report.instructionsAfter, report.cyclesAfter);
+        return report;
+    }
+};
+
+// =============================================================================
+// BRANCH OPTIMIZER
+// =============================================================================
+
+struct BranchReport {
+    size_t threadedBranches = 0;      // Retargeted past a test that branches again
+    size_t removedBranches = 0;       // Branches to the label right after them
+    size_t mergedInstructions = 0;    // Recomputed values already in their register
+    size_t deadInstructions = 0;      // Register writes nothing reads
+    size_t instructionsBefore = 0;
+    size_t instructionsAfter = 0;
+};
+
+// Optimizes the branches of if statements on the control-flow graph of the
+// instruction stream: every label starts a block and every BNE ends one,
+// with edges to its label and to the next instruction. The generator only
+// branches forward, so each analysis is one pass in program order or in
+// reverse, with states carried to labels ahead.
+//
+// The forward pass tracks what A, X and the zero flag hold (an immediate,
+// the current value of a variable, or the comparison of two such) and
+// drops instructions that recompute what is already there on every path,
+// which merges identical compare setups of adjacent ifs. The backward pass
+// works out which registers are live and
+//   - threads a branch whose target leads, with no stores, to a branch that
+//     must be taken too (the flag is untouched or recompared identically)
+//     when the live registers agree at the final target;
+//   - removes a branch to the label that follows it;
+//   - removes register writes that nothing reads, such as the setup of a
+//     removed branch or the load of a condition without a comparison (BNE
+//     tests the flag of the last CMP, not A).
+// Both passes run again if the first round changed anything.
+class BranchOptimizer {
+private:
+    static const uint8_t LIVE_A = 1;
+    static const uint8_t LIVE_X = 2;
+    static const uint8_t LIVE_ZERO = 4;
+    static const int MAX_ROUNDS = 2;         // A second round picks up what the first exposed
+    static const int MAX_HOPS = 16;          // Branches threaded through, per branch
+    static const size_t MAX_REGION = 64;     // Machine instructions skipped per hop
+    
+    struct Value {
+        enum Kind : uint8_t { UNKNOWN, IMMEDIATE, MEMORY };
+        Kind kind = UNKNOWN;
+        int32_t operand = 0;   // Immediate (8 bits) or address
+        
+        bool same(const Value& other) const {
+            return kind != UNKNOWN && kind == other.kind && operand == other.operand;
+        }
+    };
+    
+    // The zero flag as set by CMP: whether `left` (A) equalled `right` (X)
+    struct Flag {
+        Value left;
+        Value right;
+        
+        bool same(const Flag& other) const {
+            return (left.same(other.left) && right.same(other.right)) ||
+                   (left.same(other.right) && right.same(other.left));
+        }
+    };
+    
+    struct State {
+        Value a;
+        Value x;
+        Flag zero;
+        bool reached = false;
+    };
+    
+    BranchReport report;
+    vector<Instruction>* code;
+    vector<bool> removed;
+    vector<size_t> labelIndex;                  // Per label: its position
+    vector<State> labelStates;                  // Per label: meet of the incoming states
+    vector<pair<size_t, State>> branchStates;   // State at each BNE, in program order
+    vector<uint8_t> labelLive;                  // Per label: registers live there
+    vector<size_t> following;                   // Per position: next kept machine instruction
+    vector<Value> stack;
+    vector<bool> pops;
+    
+    static void forget(Value& value, int32_t address) {
+        if (value.kind == Value::MEMORY && value.operand == address) value = Value();
+    }
+    
+    static void meet(State& into, const State& from) {
+        if (!into.reached) {
+            into = from;
+            return;
+        }
+        if (!into.a.same(from.a)) into.a = Value();
+        if (!into.x.same(from.x)) into.x = Value();
+        if (!into.zero.same(from.zero)) into.zero = Flag();
+    }
+    
+    // Positions every label. Returns false unless each label is defined once
+    // and every branch goes forward to one, which the passes rely on.
+    bool indexLabels() {
+        const vector<Instruction>& insts = *code;
+        int32_t labels = 0;
+        for (const Instruction& inst : insts) {
+            if (inst.op == Opcode::LABEL || inst.op == Opcode::BNE) {
+                if (inst.operand < 0) return false;
+                labels = max(labels, inst.operand + 1);
+            }
+        }
+        labelIndex.assign(labels, SIZE_MAX);
+        for (size_t i = 0; i < insts.size(); i++) {
+            if (insts[i].op != Opcode::LABEL) continue;
+            if (labelIndex[insts[i].operand] != SIZE_MAX) return false;
+            labelIndex[insts[i].operand] = i;
+        }
+        for (size_t i = 0; i < insts.size(); i++) {
+            if (insts[i].op == Opcode::BNE && labelIndex[insts[i].operand] == SIZE_MAX) return false;
+            if (insts[i].op == Opcode::BNE && labelIndex[insts[i].operand] < i) return false;
+        }
+        return true;
+    }
+    
+    bool mergeRedundant() {
+        vector<Instruction>& insts = *code;
+        labelStates.assign(labelIndex.size(), State());
+        branchStates.clear();
+        stack.clear();
+        State state;
+        state.reached = true;
+        bool changed = false;
+        
+        for (size_t i = 0; i < insts.size(); i++) {
+            Instruction& inst = insts[i];
+            bool redundant = false;
+            switch (inst.op) {
+                case Opcode::LABEL: {
+                    State& incoming = labelStates[inst.operand];
+                    if (state.reached) meet(incoming, state);
+                    state = incoming;
+                    stack.clear();
+                    break;
+                }
+                case Opcode::LDA_IMM: {
+                    Value value = {Value::IMMEDIATE, inst.operand & 0xFF};
+                    redundant = state.a.same(value);
+                    state.a = value;
+                    break;
+                }
+                case Opcode::LDA_MEM: {
+                    Value value = {Value::MEMORY, inst.operand};
+                    redundant = state.a.same(value);
+                    state.a = value;
+                    break;
+                }
+                case Opcode::STA:
+                    forget(state.x, inst.operand);
+                    forget(state.zero.left, inst.operand);
+                    forget(state.zero.right, inst.operand);
+                    for (Value& value : stack) {
+                        forget(value, inst.operand);
+                    }
+                    // A still holds what the variable now holds
+                    if (state.a.kind == Value::UNKNOWN) state.a = {Value::MEMORY, inst.operand};
+                    break;
+                case Opcode::PHA:
+                    stack.push_back(state.a);
+                    break;
+                case Opcode::PLA:
+                    state.a = stack.empty() ? Value() : stack.back();
+                    if (!stack.empty()) stack.pop_back();
+                    break;
+                case Opcode::TAX:
+                    redundant = state.x.same(state.a);
+                    state.x = state.a;
+                    break;
+                case Opcode::ADC_X:
+                case Opcode::SBC_X:
+                    state.a = Value();
+                    break;
+                case Opcode::CMP_X: {
+                    Flag flag = {state.a, state.x};
+                    redundant = state.zero.same(flag);
+                    state.zero = flag;
+                    break;
+                }
+                case Opcode::BNE:
+                    branchStates.push_back({i, state});
+                    meet(labelStates[inst.operand], state);
+                    break;
+                case Opcode::HLT:
+                    state = State();
+                    break;
+                default:
+                    break;
+            }
+            if (redundant) {
+                removed[i] = true;
+                report.mergedInstructions++;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+    
+    // Follows the branch at `branch` to its target while that leads, through
+    // instructions that store nothing, to another branch taken on the same
+    // flag, and retargets it there when the registers live at the new target
+    // hold the same values on both paths. `at` is the state at the branch.
+    bool thread(size_t branch, const State& at) {
+        vector<Instruction>& insts = *code;
+        State state = at;   // Along the original path
+        bool writesA = false, writesX = false;
+        bool threaded = false;
+        
+        for (int hop = 0; hop < MAX_HOPS; hop++) {
+            size_t steps = 0;
+            bool compared = false;
+            stack.clear();
+            // Stacked labels and removed instructions cost nothing to pass
+            size_t i = following[labelIndex[insts[branch].operand]];
+            for (; i < insts.size(); i = following[i + 1]) {
+                Opcode op = insts[i].op;
+                if (op == Opcode::BNE || op == Opcode::STA || op == Opcode::HLT || ++steps > MAX_REGION) break;
+                switch (op) {
+                    case Opcode::LDA_IMM: state.a = {Value::IMMEDIATE, insts[i].operand & 0xFF}; break;
+                    case Opcode::LDA_MEM: state.a = {Value::MEMORY, insts[i].operand}; break;
+                    case Opcode::PHA: stack.push_back(state.a); break;
+                    case Opcode::TAX: state.x = state.a; writesX = true; break;
+                    case Opcode::CMP_X: state.zero = {state.a, state.x}; compared = true; break;
+                    case Opcode::PLA:
+                        if (stack.empty()) return threaded;
+                        state.a = stack.back();
+                        stack.pop_back();
+                        break;
+                    default: state.a = Value(); break;
+                }
+                if (op != Opcode::TAX && op != Opcode::CMP_X && op != Opcode::PHA) writesA = true;
+            }
+            if (i == insts.size() || insts[i].op != Opcode::BNE || !stack.empty()) return threaded;
+            if (compared && !state.zero.same(at.zero)) return threaded;
+            
+            uint8_t live = labelLive[insts[i].operand];
+            if ((live & LIVE_A) && writesA && !state.a.same(at.a)) return threaded;
+            if ((live & LIVE_X) && writesX && !state.x.same(at.x)) return threaded;
+            insts[branch].operand = insts[i].operand;
+            report.threadedBranches++;
+            threaded = true;
+        }
+        return threaded;
+    }
+    
+    bool optimizeBranches() {
+        vector<Instruction>& insts = *code;
+        labelLive.assign(labelIndex.size(), 0);
+        pops.clear();
+        uint8_t live = 0;
+        size_t nextMachine = insts.size();
+        size_t cursor = branchStates.size();
+        bool changed = false;
+        // Everything after i is final by the time thread() looks at it
+        following.resize(insts.size() + 1);
+        
+        for (size_t i = insts.size(); i-- > 0; ) {
+            following[i + 1] = nextMachine;
+            if (removed[i]) continue;
+            Instruction& inst = insts[i];
+            if (inst.op == Opcode::LABEL) {
+                labelLive[inst.operand] = live;
+                pops.clear();
+                continue;
+            }
+            if (!isMachineInstruction(inst.op)) continue;
+            
+            uint8_t defines = 0, uses = 0;
+            bool dead = false;
+            switch (inst.op) {
+                case Opcode::BNE:
+                    // Falling through costs less than any threading
+                    dead = labelIndex[inst.operand] < nextMachine;
+                    if (dead) {
+                        report.removedBranches++;
+                        break;
+                    }
+                    while (branchStates[cursor - 1].first != i) cursor--;
+                    if (thread(i, branchStates[cursor - 1].second)) changed = true;
+                    uses = LIVE_ZERO;
+                    pops.clear();
+                    break;
+                case Opcode::HLT:
+                    live = 0;
+                    break;
+                case Opcode::STA:
+                    uses = LIVE_A;
+                    break;
+                case Opcode::PHA:
+                    // Goes with the PLA it feeds
+                    dead = !pops.empty() && pops.back();
+                    if (!pops.empty()) pops.pop_back();
+                    uses = LIVE_A;
+                    break;
+                case Opcode::PLA:
+                    defines = LIVE_A;
+                    dead = !(live & LIVE_A);
+                    pops.push_back(dead);
+                    break;
+                case Opcode::TAX:
+                    defines = LIVE_X;
+                    uses = LIVE_A;
+                    break;
+                case Opcode::ADC_X:
+                case Opcode::SBC_X:
+                    defines = LIVE_A;
+                    uses = LIVE_A | LIVE_X;
+                    break;
+                case Opcode::CMP_X:
+                    defines = LIVE_ZERO;
+                    uses = LIVE_A | LIVE_X;
+                    break;
+                default:   // Loads
+                    defines = LIVE_A;
+                    break;
+            }
+            if (defines && inst.op != Opcode::PLA && !(live & defines)) dead = true;
+            if (dead) {
+                removed[i] = true;
+                if (inst.op != Opcode::BNE) report.deadInstructions++;
+                changed = true;
+                continue;
+            }
+            if (inst.op == Opcode::BNE) live |= labelLive[inst.operand];
+            live = (live & ~defines) | uses;
+            nextMachine = i;
+        }
+        return changed;
+    }
+    
+public:
+    BranchOptimizer() : code(nullptr) {}
+    
+    const BranchReport& optimize(vector<Instruction>& insts) {
+        report = BranchReport();
+        code = &insts;
+        report.instructionsBefore = countMachineInstructions(insts);
+        
+        bool changed = true;
+        for (int round = 0; changed && round < MAX_ROUNDS && indexLabels(); round++) {
+            removed.assign(insts.size(), false);
+            changed = mergeRedundant();
+            changed = optimizeBranches() || changed;
+            
+            size_t out = 0;
+            for (size_t i = 0; i < insts.size(); i++) {
+                if (!removed[i]) insts[out++] = insts[i];
+            }
+            insts.resize(out);
+        }
+        
+        report.instructionsAfter = countMachineInstructions(insts);
+        return report;
+    }
+};
+
+// =============================================================================
+// SIMULATOR
+// =============================================================================
+
+// Executes the instruction subset emitted by CodeGenerator on a model of the
+// 8-bit CPU: accumulator A, index register X, a zero flag that only CMP sets,
+// 256 bytes of RAM and a separate 256-entry hardware stack. Arithmetic wraps
+// modulo 256; the generator never manages carry, so ADC/SBC ignore it, and
+// immediates are truncated to 8 bits like an 8-bit assembler would.
+//
+// Instructions are decoded once into a flat array with resolved branch
+// targets, then executed by a threaded dispatch loop (computed goto on
+// GCC/Clang, a switch elsewhere).
+class Simulator {
+public:
+    struct Variable {
+        string name;
+        uint8_t address;
+    };
+    
+    struct State {
+        uint8_t a = 0;
+        uint8_t x = 0;
+        bool zero = false;
+        array<uint8_t, 256> memory{};
+        uint64_t steps = 0;
+    };
+    
+private:
+    struct DecodedInstruction {
+        Opcode op;
+        uint8_t operand;
+        uint32_t target;   // BNE: index into program
+    };
+    
+    vector<DecodedInstruction> program;
+    vector<Variable> variables;
+    
+public:
+    void load(const vector<Instruction>& code, const SymbolTable& symbols) {
+        program.clear();
+        variables.clear();
+        vector<uint32_t> labelTargets;
+        vector<pair<size_t, int32_t>> branches;   // program index, label number
+        
+        for (const Instruction& inst : code) {
+            if (inst.op == Opcode::LABEL) {
+                if ((size_t)inst.operand >= labelTargets.size()) {
+                    labelTargets.resize(inst.operand + 1, UINT32_MAX);
+                }
+                labelTargets[inst.operand] = (uint32_t)program.size();
+            } else if (inst.op == Opcode::DECLARE) {
+                variables.push_back({symbols.name(inst.symbol), (uint8_t)inst.operand});
+            } else if (isMachineInstruction(inst.op)) {
+                if (inst.op == Opcode::BNE) branches.push_back({program.size(), inst.operand});
+                program.push_back({inst.op, (uint8_t)(inst.operand & 0xFF), 0});
+            }
+        }
+        
+        for (const auto& branch : branches) {
+            if ((size_t)branch.second >= labelTargets.size() || labelTargets[branch.second] == UINT32_MAX) {
+                throw runtime_error("Simulator: undefined label L" + to_string(branch.second));
+            }
+            program[branch.first].target = labelTargets[branch.second];
+        }
+        
+        // Running off the end behaves like HLT; the sentinel also gives
+        // labels placed after the last instruction a valid target.
+        program.push_back({Opcode::HLT, 0, 0});
+    }
+    
+    const vector<Variable>& getVariables() const { return variables; }
+    size_t instructionCount() const { return program.size() - 1; }
+    
+    // Runs from the first instruction until HLT. Backward branches can loop in
+    // hand-written assembly, so taken branches enforce the step limit.
+    State run(uint64_t maxSteps = 1000000000) const {
+        State state;
+        uint8_t a = 0, x = 0;
+        bool zero = false;
+        uint8_t* memory = state.memory.data();
+        uint8_t stack[256];
+        unsigned sp = 0;
+        uint64_t steps = 0;
+        const DecodedInstruction* code = program.data();
+        const DecodedInstruction* pc = code;
+        const char* fault = nullptr;
+        
+#if defined(__GNUC__)
+        static void* const dispatchTable[] = {
+            &&do_lda_imm, &&do_lda_mem, &&do_sta, &&do_pha, &&do_pla, &&do_tax,
+            &&do_adc_x, &&do_sbc_x, &&do_cmp_x, &&do_bne, &&do_hlt
+        };
+#define SIM_CASE(label, opcode) label:
+#define SIM_NEXT() do { steps++; goto *dispatchTable[(size_t)(pc++)->op]; } while (0)
+        SIM_NEXT();
+#else
+#define SIM_CASE(label, opcode) case opcode:
+#define SIM_NEXT() break
+        for (;;) {
+            steps++;
+            switch ((pc++)->op) {
+#endif
+        SIM_CASE(do_lda_imm, Opcode::LDA_IMM)
+            a = pc[-1].operand;
+            SIM_NEXT();
+        SIM_CASE(do_lda_mem, Opcode::LDA_MEM)
+            a = memory[pc[-1].operand];
+            SIM_NEXT();
+        SIM_CASE(do_sta, Opcode::STA)
+            memory[pc[-1].operand] = a;
+            SIM_NEXT();
+        SIM_CASE(do_pha, Opcode::PHA)
+            if (sp == sizeof(stack)) { fault = "stack overflow"; goto done; }
+            stack[sp++] = a;
+            SIM_NEXT();
+        SIM_CASE(do_pla, Opcode::PLA)
+            if (sp == 0) { fault = "stack underflow"; goto done; }
+            a = stack[--sp];
+            SIM_NEXT();
+        SIM_CASE(do_tax, Opcode::TAX)
+            x = a;
+            SIM_NEXT();
+        SIM_CASE(do_adc_x, Opcode::ADC_X)
+            a = (uint8_t)(a + x);
+            SIM_NEXT();
+        SIM_CASE(do_sbc_x, Opcode::SBC_X)
+            a = (uint8_t)(a - x);
+            SIM_NEXT();
+        SIM_CASE(do_cmp_x, Opcode::CMP_X)
+            zero = a == x;
+            SIM_NEXT();
+        SIM_CASE(do_bne, Opcode::BNE)
+            if (!zero) {
+                if (steps >= maxSteps) { fault = "step limit exceeded"; goto done; }
+                pc = code + pc[-1].target;
+            }
+            SIM_NEXT();
+        SIM_CASE(do_hlt, Opcode::HLT)
+            goto done;
+#if !defined(__GNUC__)
+            }
+        }
+#endif
+#undef SIM_CASE
+#undef SIM_NEXT
+        
+    done:
+        if (fault) {
+            throw runtime_error(string("Simulator: ") + fault + " at instruction " + 
+                              to_string(pc - code - 1));
+        }
+        state.a = a;
+        state.x = x;
+        state.zero = zero;
+        state.steps = steps;
+        return state;
+    }
+};
+
+// Decodes and runs a program, then reports the final register state and the
+// final values of the output variables (the others may share an address).
+// Returns false if the program cannot be decoded or faults.
+bool simulateProgram(const vector<Instruction>& code, const SymbolTable& symbols, 
+                     DiagnosticSink& out, DiagnosticSink& errors, const vector<string>& outputs = {}) {
+    try {
+        Simulator simulator;
+        simulator.load(code, symbols);
+        
+        auto start = chrono::steady_clock::now();
+        Simulator::State state = simulator.run();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        out << "\n=== SIMULATION ===\n";
+        out << "Halted after " << state.steps << " instructions";
+        if (seconds > 0) {
+            char rate[32];
+            snprintf(rate, sizeof(rate), " (%.1f MIPS)", state.steps / seconds / 1e6);
+            out << rate;
+        }
+        out << '\n';
+        out << "A = " << (int)state.a << ", X = " << (int)state.x << '\n';
+        for (const auto& variable : simulator.getVariables()) {
+            if (!isOutputVariable(outputs, variable.name)) continue;
+            out << variable.name << " = " << (int)state.memory[variable.address] 
+                << "  ($" << (int)variable.address << ")\n";
+        }
+        return true;
+    } catch (const exception& e) {
+        errors << "Simulation error: " << e.what() << '\n';
+        return false;
+    }
+}
+
+// =============================================================================
+// COMPILATION CACHE
+// =============================================================================
+
+// Part of every cache key and incremental state. Bump it with any change
+// that alters the listing produced for some input, so entries written by
+// an older compiler stop matching; rebuilding an unchanged compiler keeps
+// the cache warm and the keys reproducible.
+const char* const COMPILER_OUTPUT_VERSION = "simplelang-output-1";
+
+// 64-bit multiply-rotate hash over 8-byte words; fast enough that hashing
+// a source costs far less than lexing it.
+uint64_t hashBytes(string_view data, uint64_t seed) {
+    const uint64_t K1 = 0x9E3779B97F4A7C15ULL;
+    const uint64_t K2 = 0xBF58476D1CE4E5B9ULL;
+    uint64_t h = seed ^ (data.size() * K1);
+    
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, data.data() + i, 8);
+        h = (h ^ (word * K1)) * K2;
+        h = (h << 31) | (h >> 33);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data.data() + i, data.size() - i);
+    h = (h ^ (tail * K1)) * K2;
+    
+    h ^= h >> 30;
+    h *= K2;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return h;
+}
+
+// On-disk store of emitted listings keyed by source text plus output
+// format version and options. Entries are "<key>.slc" files holding a
+// small header and the listing; a hit refreshes the entry's mtime so
+// eviction drops the least recently used entries first once the directory
+// outgrows its budget.
+// Failures here are never fatal: the compiler simply compiles.
+class CompilationCache {
+public:
+    struct Key {
+        uint64_t primary = 0;       // Names the entry file
+        uint64_t check = 0;         // Independent hash guarding against collisions
+        uint64_t sourceBytes = 0;
+    };
+    
+    // Everything a hit restores, so no phase has to run again.
+    struct Output {
+        string_view assembly;
+        string_view image;          // Empty when the code does not fit below the data region
+        uint64_t codeBytes = 0;
+        uint64_t memoryBytes = 0;
+    };
+    
+private:
+    // Followed by the image, then the listing.
+    struct EntryHeader {
+        char magic[8];
+        uint64_t sourceBytes;
+        uint64_t check;
+        uint64_t codeBytes;
+        uint64_t memoryBytes;
+        uint64_t imageBytes;        // 0 or IMAGE_SIZE
+    };
+    
+    static constexpr char MAGIC[8] = {'S', 'L', 'C', 'A', 'C', 'H', 'E', '2'};
+    
+    string directory;
+    uint64_t maxBytes;
+    mutex lock;                 // Guards the size estimate; shared by batch workers
+    bool sized = false;
+    uint64_t currentBytes = 0;
+    
+    string entryPath(const Key& key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.slc", (unsigned long long)key.primary);
+        return directory + name;
+    }
+    
+    // Rescans the directory and, if over budget, removes the oldest entries
+    // until a quarter of the budget is free so the scan is not repeated on
+    // every store. Returns the number of entries removed.
+    size_t evict() {
+        struct Entry {
+            string path;
+            timespec modified;
+            uint64_t bytes;
+        };
+        vector<Entry> entries;
+        uint64_t total = 0;
+        
+        DIR* dir = opendir(directory.c_str());
+        if (!dir) return 0;
+        while (dirent* item = readdir(dir)) {
+            string_view name = item->d_name;
+            if (name.size() < 4 || name.substr(name.size() - 4) != ".slc") continue;
+            string path = directory + "/" + item->d_name;
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0) continue;
+            entries.push_back({path, info.st_mtim, (uint64_t)info.st_size});
+            total += (uint64_t)info.st_size;
+        }
+        closedir(dir);
+        
+        size_t removed = 0;
+        if (total > maxBytes) {
+            sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+                if (a.modified.tv_sec != b.modified.tv_sec) return a.modified.tv_sec < b.modified.tv_sec;
+                return a.modified.tv_nsec < b.modified.tv_nsec;
+            });
+            uint64_t target = maxBytes - maxBytes / 4;
+            for (const Entry& entry : entries) {
+                if (total <= target) break;
+                if (unlink(entry.path.c_str()) == 0) removed++;
+                total -= entry.bytes;
+            }
+        }
+        currentBytes = total;
+        sized = true;
+        return removed;
+    }
+    
+public:
+    CompilationCache(const string& dir, uint64_t budgetBytes) 
+        : directory(dir), maxBytes(budgetBytes) {}
+    
+    const string& getDirectory() const { return directory; }
+    
+    static Key makeKey(string_view source, string_view configuration) {
+        uint64_t configHash = hashBytes(configuration, 0);
+        Key key;
+        key.primary = hashBytes(source, configHash);
+        key.check = hashBytes(source, configHash ^ 0x5851F42D4C957F2DULL);
+        key.sourceBytes = source.size();
+        return key;
+    }
+    
+    // Maps the entry for `key` into `entry` and points `output` into it.
+    bool lookup(const Key& key, SourceBuffer& entry, Output& output) {
+        string path = entryPath(key);
+        if (!entry.loadFile(path)) return false;
+        
+        string_view data = entry.text();
+        EntryHeader header;
+        if (data.size() < sizeof(header)) return false;
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || 
+            header.sourceBytes != key.sourceBytes || header.check != key.check ||
+            (header.imageBytes != 0 && header.imageBytes != IMAGE_SIZE) ||
+            data.size() - sizeof(header) < header.imageBytes) {
+            return false;
+        }
+        
+        utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+        data.remove_prefix(sizeof(header));
+        output.image = data.substr(0, header.imageBytes);
+        output.assembly = data.substr(header.imageBytes);
+        output.codeBytes = header.codeBytes;
+        output.memoryBytes = header.memoryBytes;
+        return true;
+    }
+    
+    // Publishes an entry atomically (write to a private temporary, then
+    // rename) and evicts if the directory has outgrown its budget. Returns
+    // the number of entries evicted.
+    size_t store(const Key& key, const Output& output) {
+        uint64_t bytes = sizeof(EntryHeader) + output.image.size() + output.assembly.size();
+        // An entry larger than the whole budget would only evict everything
+        // else and then itself.
+        if (bytes > maxBytes) return 0;
+        mkdir(directory.c_str(), 0755);
+        
+        EntryHeader header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.sourceBytes = key.sourceBytes;
+        header.check = key.check;
+        header.codeBytes = output.codeBytes;
+        header.memoryBytes = output.memoryBytes;
+        header.imageBytes = output.image.size();
+        string contents;
+        contents.reserve(bytes);
+        contents.append((const char*)&header, sizeof(header));
+        contents.append(output.image);
+        contents.append(output.assembly);
+        
+        string path = entryPath(key);
+        string temporary = path + ".tmp" + to_string(getpid()) + "." 
+                         + to_string(hash<thread::id>()(this_thread::get_id()));
+        struct stat previous;
+        uint64_t replaced = stat(path.c_str(), &previous) == 0 ? (uint64_t)previous.st_size : 0;
+        if (!writeFile(temporary, contents) || rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return 0;
+        }
+        
+        lock_guard<mutex> guard(lock);
+        if (!sized) return evict();
+        // An overwritten entry no longer takes up space
+        currentBytes += contents.size();
+        currentBytes -= min(currentBytes, replaced);
+        return currentBytes > maxBytes ? evict() : 0;
+    }
+};
+
+// =============================================================================
+// INCREMENTAL STATE
+// =============================================================================
+
+// What an incremental compile remembers about the previous one: the byte
+// span and hash of every top-level statement, and the code generated for
+// it before peephole optimization. Spans partition the source: a statement
+// runs from the end of the one before it (so it owns its leading comments
+// and whitespace) to its closing ';' or '}'. Blocks keep symbols on memory
+// operands and number their labels from 0, so CodeGenerator::appendBlock
+// can re-link them at any position.
+struct IncrementalState {
+    struct Statement {
+        uint64_t end;                 // Byte offset one past the statement
+        uint64_t hash;                // hashBytes of the statement's span
+        uint32_t firstInstruction;
+        uint32_t instructionCount;
+        uint32_t labelCount;
+    };
+    
+    uint64_t configurationHash = 0;
+    uint64_t sourceBytes = 0;
+    uint64_t tailHash = 0;            // Trivia after the last statement
+    vector<string> symbolNames;       // In SymbolId order
+    vector<Statement> statements;
+    vector<Instruction> instructions;
+    
+    uint64_t statementStart(size_t index) const {
+        return index == 0 ? 0 : statements[index - 1].end;
+    }
+    
+    // Every field is written little-endian at a fixed width, so the file is
+    // a pure function of the state and independent of struct layout:
+    //   magic u64, version u32, configurationHash u64, sourceBytes u64,
+    //   tailHash u64, then counts u64 of symbols, statements, instructions;
+    //   per symbol: length u32 and bytes;
+    //   per statement: end u64, hash u64, firstInstruction u32,
+    //     instructionCount u32, labelCount u32;
+    //   per instruction: op u8, operand u32, symbol u32.
+    bool save(const string& filename) const {
+        string data;
+        data.reserve(64 + symbolNames.size() * 12 + statements.size() * STATEMENT_BYTES + 
+                     instructions.size() * INSTRUCTION_BYTES);
+        putU64(data, MAGIC);
+        putU32(data, FORMAT_VERSION);
+        putU64(data, configurationHash);
+        putU64(data, sourceBytes);
+        putU64(data, tailHash);
+        putU64(data, symbolNames.size());
+        putU64(data, statements.size());
+        putU64(data, instructions.size());
+        for (const string& name : symbolNames) {
+            putU32(data, (uint32_t)name.size());
+            data.append(name);
+        }
+        for (const Statement& statement : statements) {
+            putU64(data, statement.end);
+            putU64(data, statement.hash);
+            putU32(data, statement.firstInstruction);
+            putU32(data, statement.instructionCount);
+            putU32(data, statement.labelCount);
+        }
+        for (const Instruction& instruction : instructions) {
+            data += (char)instruction.op;
+            putU32(data, (uint32_t)instruction.operand);
+            putU32(data, instruction.symbol);
+        }
+        return writeFile(filename, data);
+    }
+    
+    // Any missing, truncated, foreign or older-format file simply fails to
+    // load.
+    bool load(const string& filename) {
+        SourceBuffer file;
+        if (!file.loadFile(filename)) return false;
+        Reader in{file.text()};
+        
+        uint64_t symbolCount, statementCount, instructionCount;
+        if (in.u64() != MAGIC || in.u32() != FORMAT_VERSION) return false;
+        configurationHash = in.u64();
+        sourceBytes = in.u64();
+        tailHash = in.u64();
+        symbolCount = in.u64();
+        statementCount = in.u64();
+        instructionCount = in.u64();
+        if (!in.ok) return false;
+        
+        symbolNames.clear();
+        for (uint64_t i = 0; i < symbolCount; i++) {
+            uint32_t length = in.u32();
+            if (!in.ok || in.data.size() < length) return false;
+            symbolNames.emplace_back(in.data.substr(0, length));
+            in.data.remove_prefix(length);
+        }
+        
+        // Check the sizes up front so a corrupt count cannot make us allocate
+        if (in.data.size() / STATEMENT_BYTES < statementCount) return false;
+        statements.resize(statementCount);
+        for (Statement& statement : statements) {
+            statement.end = in.u64();
+            statement.hash = in.u64();
+            statement.firstInstruction = in.u32();
+            statement.instructionCount = in.u32();
+            statement.labelCount = in.u32();
+        }
+        if (in.data.size() != instructionCount * INSTRUCTION_BYTES) return false;
+        instructions.resize(instructionCount);
+        for (Instruction& instruction : instructions) {
+            uint8_t op = (uint8_t)in.data[0];
+            in.data.remove_prefix(1);
+            if (op > (uint8_t)Opcode::BLANK) return false;
+            instruction.op = (Opcode)op;
+            instruction.operand = (int32_t)in.u32();
+            instruction.symbol = in.u32();
+        }
+        
+        uint64_t previousEnd = 0;
+        for (const Statement& statement : statements) {
+            if (statement.end < previousEnd || statement.end > sourceBytes ||
+                (uint64_t)statement.firstInstruction + statement.instructionCount > instructions.size()) {
+                return false;
+            }
+            previousEnd = statement.end;
+        }
+        for (const Instruction& instruction : instructions) {
+            if (instruction.symbol != NO_SYMBOL && instruction.symbol >= symbolNames.size()) return false;
+        }
+        return true;
+    }
+    
+private:
+    static constexpr uint64_t MAGIC = 0x0045544154534C53ULL;   // "SLSTATE\0"
+    static const uint32_t FORMAT_VERSION = 2;                  // Bump with any layout change
+    static const size_t STATEMENT_BYTES = 28;
+    static const size_t INSTRUCTION_BYTES = 9;
+    
+    static void putU32(string& data, uint32_t value) {
+        for (int shift = 0; shift < 32; shift += 8) data += (char)(value >> shift);
+    }
+    
+    static void putU64(string& data, uint64_t value) {
+        putU32(data, (uint32_t)value);
+        putU32(data, (uint32_t)(value >> 32));
+    }
+    
+    // Consumes little-endian fields; reading past the end yields zeros and
+    // clears `ok`.
+    struct Reader {
+        string_view data;
+        bool ok = true;
+        
+        uint64_t take(int bytes) {
+            if (data.size() < (size_t)bytes) {
+                ok = false;
+                data = {};
+                return 0;
+            }
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; i++) value |= (uint64_t)(uint8_t)data[i] << (8 * i);
+            data.remove_prefix(bytes);
+            return value;
+        }
+        
+        uint32_t u32() { return (uint32_t)take(4); }
+        uint64_t u64() { return take(8); }
+    };
+};
+
+// =============================================================================
+// COMPILER CLASS - MAIN ORCHESTRATOR
+// =============================================================================
+
+struct CompilerOptions {
+    bool foldConstants = false;
+    bool eliminateDeadStores = false;
+    bool registerExpressions = false;
+    bool optimizeBranches = false;
+    PeepholeOptions peephole;
+    bool comments = true;   // Annotate the listing with comments and notes
+    bool image = false;     // Also write a binary memory image (see imagePath)
+    vector<string> outputs; // Variables whose final values matter (see isOutputVariable)
+};
+
+// What the compiler reports while it works. Quiet runs produce no
+// diagnostic output at all; errors still go to stderr.
+struct DiagnosticOptions {
+    bool quiet = false;         // Suppress phase banners, reports and the listing
+    bool traceTokens = false;   // Print every token as it is scanned
+    bool dumpAst = false;       // Print the AST after parsing (and folding)
+};
+
+// Everything besides the source that affects the emitted listing.
+string listingConfiguration(const CompilerOptions& options) {
+    string configuration = COMPILER_OUTPUT_VERSION;
+    configuration += options.foldConstants ? 'F' : '-';
+    configuration += options.eliminateDeadStores ? 'E' : '-';
+    configuration += options.registerExpressions ? 'R' : '-';
+    configuration += options.optimizeBranches ? 'B' : '-';
+    configuration += options.peephole.pushPop ? 'P' : '-';
+    configuration += options.peephole.deadLoads ? 'D' : '-';
+    configuration += options.peephole.storeReload ? 'S' : '-';
+    configuration += options.comments ? 'C' : '-';
+    for (const string& output : options.outputs) {
+        configuration += ',' + output;
+    }
+    return configuration;
+}
+
+// Applies one command-line flag that selects a CompilerOptions field.
+// Returns false if `arg` is not such a flag; a malformed one throws.
+bool parseCompilerOption(const string& arg, CompilerOptions& options) {
+    if (arg == "-O") {
+        options.foldConstants = true;
+        options.eliminateDeadStores = true;
+        options.registerExpressions = true;
+        options.optimizeBranches = true;
+        options.peephole.pushPop = options.peephole.deadLoads = options.peephole.storeReload = true;
+    } else if (arg.compare(0, 11, "--peephole=") == 0) {
+        // Comma-separated rule list: push-pop, dead-loads, store-reload
+        stringstream rules(arg.substr(11));
+        string rule;
+        while (getline(rules, rule, ',')) {
+            if (rule == "push-pop") options.peephole.pushPop = true;
+            else if (rule == "dead-loads") options.peephole.deadLoads = true;
+            else if (rule == "store-reload") options.peephole.storeReload = true;
+            else if (rule != "none") throw runtime_error("Unknown peephole rule " + rule);
+        }
+    } else if (arg == "--fold-constants") {
+        options.foldConstants = true;
+    } else if (arg == "--eliminate-dead-stores") {
+        options.eliminateDeadStores = true;
+    } else if (arg == "--register-expressions") {
+        options.registerExpressions = true;
+    } else if (arg == "--optimize-branches") {
+        options.optimizeBranches = true;
+    } else if (arg.compare(0, 10, "--outputs=") == 0) {
+        // Comma-separated variable names; "prefix*" matches by prefix
+        stringstream names(arg.substr(10));
+        string name;
+        while (getline(names, name, ',')) {
+            if (!name.empty()) options.outputs.push_back(name);
+        }
+    } else if (arg == "--image") {
+        options.image = true;
+    } else if (arg == "--no-comments") {
+        options.comments = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// foo.asm -> foo.bin; other names get ".bin" appended.
+string imagePath(const string& outputFilename) {
+    size_t dot = outputFilename.rfind('.');
+    if (dot != string::npos && outputFilename.compare(dot, string::npos, ".asm") == 0) {
+        return outputFilename.substr(0, dot) + ".bin";
+    }
+    return outputFilename + ".bin";
+}
+
+class SimpleLangCompiler {
+private:
+    SourceBuffer source;
+    string sourceName = "<input>";   // Prefixes diagnostics
+    CompilerOptions options;
+    DiagnosticOptions diagnostics;
+    DiagnosticSink log;
+    DiagnosticSink errors;
+    ostream* resultStream;   // Simulation results, printed even in quiet mode
+    bool runAfterCompile = false;
+    bool collectStats = false;
+    CompileStats stats;
+    CompilationCache* cache = nullptr;
+    bool incremental = false;
+    
+public:
+    SimpleLangCompiler() : log(&cout), errors(&cerr), resultStream(&cout) {}
+    
+    bool loadSource(const string& filename) {
+        if (!source.loadFile(filename)) {
+            errors << "Error: Could not open source file " << filename << '\n';
+            errors.flush();
+            return false;
+        }
+        sourceName = filename;
+        
+        if (!diagnostics.quiet) {
+            log << "Source code " << (source.isMapped() ? "mapped" : "loaded") 
+                << " from " << filename << '\n';
+        }
+        return true;
+    }
+    
+    void setSource(const string& code) {
+        source.assign(code);
+        sourceName = "<input>";
+    }
+    
+    void setOptions(const CompilerOptions& opts) {
+        options = opts;
+    }
+    
+    // Progress output goes to `out` (subject to the diagnostic options) and
+    // errors to `err`. Concurrent compilers should each get their own streams.
+    void setDiagnostics(const DiagnosticOptions& opts, ostream* out = &cout, ostream* err = &cerr) {
+        diagnostics = opts;
+        bool anyOutput = !opts.quiet || opts.traceTokens || opts.dumpAst;
+        log.setStream(anyOutput ? out : nullptr);
+        errors.setStream(err);
+        resultStream = out;
+    }
+    
+    // Record per-phase timings and counters (adds a clock read per token).
+    void setCollectStats(bool collect) {
+        collectStats = collect;
+        if (collect) enableAllocationCounting();
+    }
+    
+    const CompileStats& getStats() const {
+        return stats;
+    }
+    
+    // Reuse listings for unchanged sources. The cache may be shared between
+    // compilers, including ones running on other threads.
+    void setCache(CompilationCache* compilationCache) {
+        cache = compilationCache;
+    }
+    
+    // Keep per-statement state next to the output (<output>.slstate) and,
+    // when it matches, re-parse and re-generate only the changed statements.
+    void setIncremental(bool enable) {
+        incremental = enable;
+    }
+    
+    // Execute the generated program on the built-in simulator after compiling.
+    void setRunAfterCompile(bool run) {
+        runAfterCompile = run;
+    }
+    
+    bool compile(const string& outputFilename = "output.asm") {
+        bool verbose = !diagnostics.quiet;
+        bool success = compilePhases(outputFilename, verbose);
+        log.flush();
+        errors.flush();
+        return success;
+    }
+    
+private:
+    bool compilePhases(const string& outputFilename, bool verbose) {
+        stats = CompileStats();
+        stats.sourceBytes = source.text().size();
+        
+        // Runs and token/AST dumps need the compiler's internal state, so
+        // they always take the full pipeline.
+        bool cacheable = cache && !runAfterCompile && !diagnostics.traceTokens && !diagnostics.dumpAst;
+        CompilationCache::Key cacheKey;
+        if (cacheable) {
+            PhaseTimer timer(stats[Phase::EMIT]);
+            cacheKey = CompilationCache::makeKey(source.text(), listingConfiguration(options));
+            SourceBuffer entry;
+            CompilationCache::Output cached;
+            if (cache->lookup(cacheKey, entry, cached)) {
+                stats.cacheHits = 1;
+                stats.codeBytes = cached.codeBytes;
+                stats.memoryBytes = cached.memoryBytes;
+                if (options.image) {
+                    try {
+                        checkCodeFits(cached.codeBytes);
+                    } catch (const exception& e) {
+                        errors << "Compilation error: " << e.what() << '\n';
+                        return false;
+                    }
+                    if (!writeImage(cached.image, cached.codeBytes, outputFilename, verbose)) return false;
+                }
+                if (verbose) {
+                    log << "\n=== GENERATED ASSEMBLY (cached) ===\n";
+                    log << cached.assembly;
+                }
+                if (!writeFile(outputFilename, cached.assembly)) {
+                    errors << "Error: Could not open file " << outputFilename << " for writing\n";
+                    return false;
+                }
+                if (verbose) log << "Assembly code saved to " << outputFilename << '\n';
+                return true;
+            }
+            stats.cacheMisses = 1;
+        }
+        
+        // Statement-level reuse needs each statement's code to depend only on
+        // the declarations before it, which constant propagation breaks.
+        bool trackStatements = incremental && !options.foldConstants && !options.eliminateDeadStores && 
+                               !diagnostics.traceTokens && !diagnostics.dumpAst;
+        string statePath = outputFilename + ".slstate";
+        uint64_t configurationHash = hashBytes(listingConfiguration(options), 0);
+        
+        try {
+            if (trackStatements) {
+                IncrementalState previous;
+                if (previous.load(statePath) && previous.configurationHash == configurationHash) {
+                    SymbolTable symbols;
+                    AST ast;
+                    CodeGenerator generator(symbols, options.registerExpressions);
+                    IncrementalState next;
+                    if (compileIncrementally(previous, symbols, ast, generator, next, verbose)) {
+                        next.configurationHash = configurationHash;
+                        return compileBackEnd(symbols, generator, outputFilename, verbose, 
+                                              cacheable ? &cacheKey : nullptr, &next, statePath);
+                    }
+                    // Fall back to a full compile, which also reports any error
+                    CompileStats fresh;
+                    fresh.sourceBytes = stats.sourceBytes;
+                    fresh.cacheMisses = stats.cacheMisses;
+                    stats = fresh;
+                }
+            }
+            
+            if (verbose) log << "\n=== LEXICAL AND SYNTAX ANALYSIS ===\n";
+            SymbolTable symbols;
+            Lexer lexer(source.text(), symbols);
+            if (diagnostics.traceTokens) lexer.setTrace(&log);
+            if (collectStats) lexer.setStats(&stats[Phase::LEX]);
+            
+            // The parser drives the lexer, so lexing time is carved out of
+            // the parse phase afterwards.
+            AST ast;
+            vector<const char*> statementEnds;
+            size_t syntaxErrors;
+            {
+                PhaseTimer timer(stats[Phase::PARSE]);
+                Parser parser(lexer);
+                if (trackStatements) parser.recordStatementEnds(&statementEnds);
+                ast = parser.parse();
+                syntaxErrors = parser.getDiagnostics().size();
+                for (const Diagnostic& diagnostic : parser.getDiagnostics()) {
+                    errors << sourceName << ':' << diagnostic.line << ':' << diagnostic.column 
+                           << ": error: " << diagnostic.message << '\n';
+                }
+                if (syntaxErrors > 0) {
+                    errors << syntaxErrors << (syntaxErrors == 1 ? " error" : " errors") 
+                           << " in " << sourceName << '\n';
+                }
+            }
+            stats[Phase::PARSE].subtract(stats[Phase::LEX]);
+            stats.tokens = lexer.getTokenCount();
+            stats.astNodes = ast.nodes.size();
+            stats.statements = ast.statements.size();
+            if (verbose && syntaxErrors == 0) log << "Abstract Syntax Tree generated successfully\n";
+            
+            if (options.foldConstants) {
+                PhaseTimer timer(stats[Phase::OPTIMIZE]);
+                ConstantFolder folder(ast, symbols);
+                const FoldReport& report = folder.fold();
+                if (verbose) {
+                    log << "\n=== CONSTANT FOLDING ===\n";
+                    log << "Folded " << report.foldedOperations << " operations, propagated " 
+                        << report.propagatedConstants << " constants, eliminated " 
+                        << report.eliminatedIfs << " if statements\n";
+                }
+            }
+            
+            if (options.eliminateDeadStores) {
+                PhaseTimer timer(stats[Phase::OPTIMIZE]);
+                DeadStoreEliminator eliminator(ast, symbols, options.outputs);
+                const DeadStoreReport& report = eliminator.eliminate();
+                if (verbose) {
+                    log << "\n=== DEAD STORE ELIMINATION ===\n";
+                    if (report.applied) {
+                        log << "Removed " << report.deadStores << " dead assignments and " 
+                            << report.unusedDeclarations << " unused declarations\n";
+                    } else {
+                        log << "Skipped: the program uses an undeclared variable or an if "
+                               "condition without a comparison\n";
+                    }
+                }
+            }
+            
+            if (diagnostics.dumpAst) {
+                log << "\n=== ABSTRACT SYNTAX TREE ===\n";
+                ast.dump(symbols, log);
+            }
+            // The partial AST is only good for inspection
+            if (syntaxErrors > 0) return false;
+            
+            if (verbose) log << "\n=== CODE GENERATION ===\n";
+            CodeGenerator generator(symbols, options.registerExpressions);
+            IncrementalState next;
+            bool saveState = trackStatements;
+            {
+                PhaseTimer timer(stats[Phase::CODEGEN]);
+                if (saveState) {
+                    vector<uint64_t> ends;
+                    for (const char* end : statementEnds) {
+                        ends.push_back((uint64_t)(end - source.text().data()));
+                    }
+                    generateTracked(ast, generator, nullptr, 0, 0, 0, ends, symbols, next);
+                    next.configurationHash = configurationHash;
+                } else {
+                    generator.generateCode(ast);
+                }
+            }
+            
+            return compileBackEnd(symbols, generator, outputFilename, verbose, 
+                                  cacheable ? &cacheKey : nullptr, saveState ? &next : nullptr, statePath);
+            
+        } catch (const exception& e) {
+            errors << "Compilation error: " << e.what() << '\n';
+            return false;
+        }
+    }
+    
+    // Reuses the statements at both ends of the source whose bytes are
+    // unchanged since the previous compile and lexes and parses only the
+    // range between them. Returns false whenever reuse is not possible
+    // (including errors), leaving the caller to compile from scratch.
+    bool compileIncrementally(const IncrementalState& previous, SymbolTable& symbols, AST& ast, 
+                              CodeGenerator& generator, IncrementalState& next, bool verbose) {
+        string_view text = source.text();
+        size_t count = previous.statements.size();
+        
+        // Unchanged leading statements keep their offsets...
+        size_t prefix = 0;
+        while (prefix < count) {
+            const IncrementalState::Statement& statement = previous.statements[prefix];
+            uint64_t start = previous.statementStart(prefix);
+            if (statement.end > text.size() || 
+                hashBytes(text.substr(start, statement.end - start), 0) != statement.hash) {
+                break;
+            }
+            prefix++;
+        }
+        int64_t prefixEnd = (int64_t)previous.statementStart(prefix);
+        
+        // ...and unchanged trailing ones are shifted by the change in length.
+        int64_t shift = (int64_t)text.size() - (int64_t)previous.sourceBytes;
+        size_t suffix = count;
+        int64_t tailStart = (int64_t)previous.statementStart(count) + shift;
+        if (tailStart >= prefixEnd && hashBytes(text.substr(tailStart), 0) == previous.tailHash) {
+            while (suffix > prefix) {
+                const IncrementalState::Statement& statement = previous.statements[suffix - 1];
+                int64_t start = (int64_t)previous.statementStart(suffix - 1) + shift;
+                if (start < prefixEnd || 
+                    hashBytes(text.substr(start, statement.end + shift - start), 0) != statement.hash) {
+                    break;
+                }
+                suffix--;
+            }
+        }
+        
+        if (verbose) log << "\n=== INCREMENTAL LEXICAL AND SYNTAX ANALYSIS ===\n";
+        for (const string& name : previous.symbolNames) {
+            symbols.intern(name);
+        }
+        
+        // The changed range must end exactly at a statement terminator for the
+        // reused suffix to lex and parse as before; trailing comments or
+        // whitespace there belong to the next statement, so pull that one
+        // into the range and try again.
+        vector<uint64_t> ends;
+        while (true) {
+            int64_t rangeEnd = suffix < count ? (int64_t)previous.statementStart(suffix) + shift 
+                                              : (int64_t)text.size();
+            // The lexer needs a sentinel after its input, so scan a copy;
+            // token and statement positions are mapped back below.
+            string range(text.substr(prefixEnd, rangeEnd - prefixEnd));
+            Lexer lexer(range, symbols);
+            if (collectStats) lexer.setStats(&stats[Phase::LEX]);
+            vector<const char*> statementEnds;
+            {
+                PhaseTimer timer(stats[Phase::PARSE]);
+                Parser parser(lexer);
+                parser.recordStatementEnds(&statementEnds);
+                ast = parser.parse();
+                if (parser.hasErrors()) return false;
+            }
+            stats.tokens += lexer.getTokenCount();
+            
+            const char* parsedEnd = statementEnds.empty() ? range.data() : statementEnds.back();
+            if (suffix == count || parsedEnd == range.data() + range.size()) {
+                for (const char* end : statementEnds) {
+                    ends.push_back((uint64_t)(prefixEnd + (end - range.data())));
+                }
+                break;
+            }
+            suffix++;
+        }
+        stats[Phase::PARSE].subtract(stats[Phase::LEX]);
+        stats.astNodes = ast.nodes.size();
+        stats.statements = prefix + ast.statements.size() + (count - suffix);
+        if (verbose) {
+            log << "Reused " << prefix + (count - suffix) << " of " << stats.statements 
+                << " statements; re-parsed " << ast.statements.size() << '\n';
+        }
+        
+        if (verbose) log << "\n=== CODE GENERATION ===\n";
+        try {
+            PhaseTimer timer(stats[Phase::CODEGEN]);
+            generateTracked(ast, generator, &previous, prefix, suffix, shift, ends, symbols, next);
+        } catch (const runtime_error&) {
+            return false;
+        }
+        return true;
+    }
+    
+    // Generates code one top-level statement at a time: previous blocks
+    // [0, prefix), then the statements of `ast` (ending at `ends`), then
+    // previous blocks [suffix, count) moved by `shift` bytes. Records every
+    // statement's span, hash and code in `next`.
+    void generateTracked(const AST& ast, CodeGenerator& generator, const IncrementalState* previous,
+                         size_t prefix, size_t suffix, int64_t shift, const vector<uint64_t>& ends,
+                         const SymbolTable& symbols, IncrementalState& next) {
+        string_view text = source.text();
+        vector<Instruction>& code = generator.getCode();
+        
+        auto record = [&](size_t codeStart, int labelStart, uint64_t end, uint64_t hash) {
+            IncrementalState::Statement statement;
+            statement.end = end;
+            statement.hash = hash;
+            statement.firstInstruction = (uint32_t)next.instructions.size();
+            statement.instructionCount = (uint32_t)(code.size() - codeStart);
+            statement.labelCount = (uint32_t)(generator.getLabelCount() - labelStart);
+            for (size_t i = codeStart; i < code.size(); i++) {
+                Instruction instruction = code[i];
+                if (instruction.op == Opcode::LABEL || instruction.op == Opcode::BNE) {
+                    instruction.operand -= labelStart;
+                }
+                next.instructions.push_back(instruction);
+            }
+            next.statements.push_back(statement);
+        };
+        
+        auto reuse = [&](size_t index, int64_t offset) {
+            const IncrementalState::Statement& statement = previous->statements[index];
+            size_t codeStart = code.size();
+            int labelStart = generator.getLabelCount();
+            generator.appendBlock(&previous->instructions[statement.firstInstruction], 
+                                  statement.instructionCount, (int)statement.labelCount);
+            record(codeStart, labelStart, statement.end + offset, statement.hash);
+        };
+        
+        code.reserve((previous ? previous->instructions.size() : 0) + ast.nodes.size() * 4);
+        next.instructions.reserve(code.capacity());
+        next.statements.reserve(prefix + ast.statements.size() + (previous ? previous->statements.size() - suffix : 0));
+        
+        generator.begin(ast);
+        for (size_t i = 0; i < prefix; i++) {
+            reuse(i, 0);
+        }
+        
+        uint64_t start = previous ? previous->statementStart(prefix) : 0;
+        for (size_t i = 0; i < ast.statements.size(); i++) {
+            size_t codeStart = code.size();
+            int labelStart = generator.getLabelCount();
+            generator.generateStatement(ast.statements[i]);
+            record(codeStart, labelStart, ends[i], hashBytes(text.substr(start, ends[i] - start), 0));
+            start = ends[i];
+        }
+        
+        size_t count = previous ? previous->statements.size() : 0;
+        for (size_t i = suffix; i < count; i++) {
+            reuse(i, shift);
+        }
+        generator.finish();
+        
+        uint64_t lastEnd = next.statements.empty() ? 0 : next.statements.back().end;
+        next.sourceBytes = text.size();
+        next.tailHash = hashBytes(text.substr(lastEnd), 0);
+        next.symbolNames.clear();
+        for (SymbolId id = 0; id < symbols.size(); id++) {
+            next.symbolNames.push_back(symbols.name(id));
+        }
+    }
+    
+    // Writes an encoded image of `code` bytes of code next to the listing.
+    bool writeImage(string_view image, uint64_t code, const string& outputFilename, bool verbose) {
+        string path = imagePath(outputFilename);
+        if (!writeFile(path, image)) {
+            errors << "Error: Could not open file " << path << " for writing\n";
+            return false;
+        }
+        if (verbose) {
+            log << "\n=== MACHINE CODE ===\n";
+            log << "Encoded " << code << " bytes of code into a " << IMAGE_SIZE 
+                << "-byte image saved to " << path << '\n';
+        }
+        return true;
+    }
+    
+    // Peephole optimization, emission and the optional run, shared by full
+    // and incremental compiles. Saves `next` (when given) once the listing
+    // has been written.
+    bool compileBackEnd(SymbolTable& symbols, CodeGenerator& generator, const string& outputFilename, 
+                        bool verbose, const CompilationCache::Key* cacheKey, 
+                        const IncrementalState* next, const string& statePath) {
+        stats.instructionsGenerated = countMachineInstructions(generator.getCode());
+        
+        if (options.optimizeBranches) {
+            PhaseTimer timer(stats[Phase::OPTIMIZE]);
+            BranchOptimizer branches;
+            const BranchReport& report = branches.optimize(generator.getCode());
+            if (verbose) {
+                log << "\n=== BRANCH OPTIMIZATION ===\n";
+                log << "Threaded " << report.threadedBranches << " branches, removed " 
+                    << report.removedBranches << " branches to the next label, " 
+                    << report.mergedInstructions << " repeated compare setup instructions and " 
+                    << report.deadInstructions << " dead register writes (" 
+                    << report.instructionsBefore << " -> " << report.instructionsAfter << " instructions)\n";
+            }
+        }
+        
+        if (options.peephole.any()) {
+            PhaseTimer timer(stats[Phase::OPTIMIZE]);
+            PeepholeOptimizer peephole(options.peephole);
+            const PeepholeReport& report = peephole.optimize(generator.getCode());
+            if (verbose) {
+                log << "\n=== PEEPHOLE OPTIMIZATION ===\n";
+                log << "Removed " << report.instructionsBefore - report.instructionsAfter 
+                    << " of " << report.instructionsBefore << " instructions (" 
+                    << report.pushPopPairs << " push/pop pairs, " 
+                    << report.deadLoads << " dead loads, " 
+                    << report.storeReloads << " store/reload pairs)\n";
+                log << "Estimated cycles: " << report.cyclesBefore << " -> " << report.cyclesAfter 
+                    << " (" << report.cyclesBefore - report.cyclesAfter << " saved)\n";
+            }
+        }
+        stats.instructionsEmitted = countMachineInstructions(generator.getCode());
+        
+        {
+            PhaseTimer timer(stats[Phase::ALLOCATE]);
+            MemoryAllocator allocator;
+            const AllocationReport& report = allocator.allocate(generator.getCode(), symbols, options.outputs);
+            stats.memoryBytes = report.bytes;
+            stats.codeBytes = codeBytes(generator.getCode());
+            if (verbose) {
+                log << "\n=== MEMORY ALLOCATION ===\n";
+                log << "Placed " << report.variables << " variables in " << report.bytes << " of " 
+                    << MEMORY_SIZE << " bytes (" << report.shared << " sharing an address)\n";
+            }
+        }
+        
+        {
+            PhaseTimer timer(stats[Phase::EMIT]);
+            // The cache keeps the image of any code that fits, so a later
+            // hit with --image needs nothing rebuilt
+            array<uint8_t, IMAGE_SIZE> image;
+            string_view encoded;
+            if (options.image || (cacheKey && stats.codeBytes <= CODE_LIMIT)) {
+                image = encodeImage(generator.getCode());   // Throws if the code does not fit
+                encoded = string_view((const char*)image.data(), image.size());
+            }
+            if (options.image && !writeImage(encoded, stats.codeBytes, outputFilename, verbose)) return false;
+            AssemblyEmitter emitter(options.comments);
+            emitter.emit(generator.getCode(), symbols);
+            if (verbose) {
+                log << "\n=== GENERATED ASSEMBLY ===\n";
+                log << emitter.text();
+            }
+            if (!emitter.writeToFile(outputFilename)) {
+                errors << "Error: Could not open file " << outputFilename << " for writing\n";
+                return false;
+            }
+            if (verbose) log << "Assembly code saved to " << outputFilename << '\n';
+            if (cacheKey) {
+                stats.cacheEvictions = cache->store(*cacheKey, {emitter.text(), encoded, stats.codeBytes, 
+                                                                stats.memoryBytes});
+            }
+            if (next && !next->save(statePath)) {
+                errors << "Warning: Could not save incremental state to " << statePath << '\n';
+            }
+        }
+        
+        if (runAfterCompile) {
+            log.flush();
+            DiagnosticSink results(resultStream);
+            return simulateProgram(generator.getCode(), symbols, results, errors, options.outputs);
+        }
+        return true;
+    }
+};
+
+// =============================================================================
+// LIBRARY API
+// =============================================================================
+
+struct CompileResult {
+    bool success = false;
+    string assembly;                 // The listing, exactly as it would be written to a file
+    vector<uint8_t> image;           // The binary image, with CompilerOptions::image
+    vector<Diagnostic> diagnostics;  // Syntax errors in source order; other errors have line 0
+    CompileStats stats;
+};
+
+// Compiles sources held in memory, for embedding: no files, no banners, no
+// output streams. A context keeps its buffers between calls (the source
+// copy, symbol table, AST pool, instruction stream, allocator and listing),
+// so a long-running service compiling one snippet after another stops
+// allocating once it has seen its largest input; passing the same
+// CompileResult back in recycles its buffers too. One context per thread.
+class CompilerContext {
+private:
+    string text;               // The source plus the lexer's '\0' sentinel
+    SymbolTable symbols;
+    AST ast;
+    CodeGenerator generator;
+    MemoryAllocator allocator;
+    AssemblyEmitter emitter;
+    bool collectStats = false;
+    
+public:
+    CompilerContext() : generator(symbols) {}
+    
+    // The generator refers to this context's symbol table, which a copy or
+    // move would leave it pointing at.
+    CompilerContext(const CompilerContext&) = delete;
+    CompilerContext(CompilerContext&&) = delete;
+    CompilerContext& operator=(const CompilerContext&) = delete;
+    CompilerContext& operator=(CompilerContext&&) = delete;
+    
+    // Phase times are always measured; splitting lexing out of parsing
+    // costs a clock read per token, so that waits for this switch.
+    void setCollectStats(bool enable) {
+        collectStats = enable;
+        if (enable) enableAllocationCounting();
+    }
+    
+    bool compile(string_view source, const CompilerOptions& options, CompileResult& result) {
+        result.success = false;
+        result.assembly.clear();
+        result.image.clear();
+        result.diagnostics.clear();
+        result.stats = CompileStats();
+        CompileStats& stats = result.stats;
+        stats.sourceBytes = source.size();
+        
+        text.assign(source);
+        // The folder, dead store eliminator and generator size tables by
+        // the symbol count, so names from earlier snippets must not linger
+        symbols.clear();
+        vector<Instruction>& code = generator.getCode();
+        try {
+            {
+                PhaseTimer timer(stats[Phase::PARSE]);
+                Lexer lexer(text, symbols);
+                if (collectStats) lexer.setStats(&stats[Phase::LEX]);
+                Parser parser(lexer);
+                parser.reuse(move(ast));
+                ast = parser.parse();
+                result.diagnostics = parser.getDiagnostics();
+                stats.tokens = lexer.getTokenCount();
+            }
+            stats[Phase::PARSE].subtract(stats[Phase::LEX]);
+            stats.astNodes = ast.nodes.size();
+            stats.statements = ast.statements.size();
+            if (!result.diagnostics.empty()) return false;
+            
+            {
+                PhaseTimer timer(stats[Phase::OPTIMIZE]);
+                if (options.foldConstants) ConstantFolder(ast, symbols).fold();
+                if (options.eliminateDeadStores) DeadStoreEliminator(ast, symbols, options.outputs).eliminate();
+            }
+            {
+                PhaseTimer timer(stats[Phase::CODEGEN]);
+                generator.reset(options.registerExpressions);
+                generator.generateCode(ast);
+            }
+            stats.instructionsGenerated = countMachineInstructions(code);
+            if (options.optimizeBranches) {
+                PhaseTimer timer(stats[Phase::OPTIMIZE]);
+                BranchOptimizer().optimize(code);
+            }
+            if (options.peephole.any()) {
+                PhaseTimer timer(stats[Phase::OPTIMIZE]);
+                PeepholeOptimizer(options.peephole).optimize(code);
+            }
+            stats.instructionsEmitted = countMachineInstructions(code);
+            {
+                PhaseTimer timer(stats[Phase::ALLOCATE]);
+                stats.memoryBytes = allocator.allocate(code, symbols, options.outputs).bytes;
+                stats.codeBytes = codeBytes(code);
+            }
+            {
+                PhaseTimer timer(stats[Phase::EMIT]);
+                if (options.image) {
+                    array<uint8_t, IMAGE_SIZE> image = encodeImage(code);
+                    result.image.assign(image.begin(), image.end());
+                }
+                emitter.setComments(options.comments);
+                emitter.emit(code, symbols);
+                result.assembly.assign(emitter.text());
+            }
+        } catch (const exception& e) {
+            result.diagnostics.push_back({0, 0, e.what()});
+            return false;
+        }
+        result.success = true;
+        return true;
+    }
+    
+    CompileResult compile(string_view source, const CompilerOptions& options = CompilerOptions()) {
+        CompileResult result;
+        compile(source, options, result);
+        return result;
+    }
+    
+    // State of the last compile, valid until the next one: the final
+    // instructions (addresses allocated) and the symbols they refer to.
+    const vector<Instruction>& instructions() const { return generator.getCode(); }
+    const SymbolTable& symbolTable() const { return symbols; }
+};
+
+// One-shot convenience; reuse a CompilerContext when compiling repeatedly.
+CompileResult compile(string_view source, const CompilerOptions& options = CompilerOptions()) {
+    return CompilerContext().compile(source, options);
+}
+
+// =============================================================================
+// BATCH COMPILATION
+// =============================================================================
+
+// Fixed set of tasks spread over per-worker deques. A worker takes from the
+// front of its own deque and, once that is empty, steals from the back of
+// the others, so uneven file sizes balance out without a shared queue.
+// Tasks receive the index of the worker running them, letting callers keep
+// per-worker state.
+class WorkStealingPool {
+private:
+    struct WorkerQueue {
+        mutex lock;
+        deque<function<void(size_t)>> tasks;
+    };
+    
+    vector<unique_ptr<WorkerQueue>> queues;
+    
+    bool takeOwn(size_t worker, function<void(size_t)>& task) {
+        WorkerQueue& queue = *queues[worker];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) return false;
+        task = move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+    }
+    
+    bool steal(size_t thief, function<void(size_t)>& task) {
+        for (size_t offset = 1; offset < queues.size(); offset++) {
+            WorkerQueue& victim = *queues[(thief + offset) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (victim.tasks.empty()) continue;
+            task = move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+    
+    void workerLoop(size_t worker) {
+        function<void(size_t)> task;
+        // Tasks never submit tasks, so once every queue is empty we are done.
+        while (takeOwn(worker, task) || steal(worker, task)) {
+            task(worker);
+        }
+    }
+    
+public:
+    WorkStealingPool(size_t workerCount) {
+        for (size_t i = 0; i < max<size_t>(workerCount, 1); i++) {
+            queues.push_back(make_unique<WorkerQueue>());
+        }
+    }
+    
+    size_t size() const { return queues.size(); }
+    
+    void submit(size_t worker, function<void(size_t)> task) {
+        WorkerQueue& queue = *queues[worker % queues.size()];
+        lock_guard<mutex> guard(queue.lock);
+        queue.tasks.push_back(move(task));
+    }
+    
+    // Runs every submitted task and returns when all have finished.
+    void run() {
+        vector<thread> threads;
+        for (size_t i = 1; i < queues.size(); i++) {
+            threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+        workerLoop(0);
+        for (thread& t : threads) {
+            t.join();
+        }
+    }
+};
+
+struct BatchResult {
+    string source;
+    string output;
+    bool success = false;
+    string messages;   // Everything the compile wrote to its error stream
+    CompileStats stats;
+};
+
+string batchOutputPath(const string& source) {
+    size_t slash = source.find_last_of('/');
+    size_t dot = source.find_last_of('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) return source + ".asm";
+    return source.substr(0, dot) + ".asm";
+}
+
+// Compiles every source on its own output path (foo.sl -> foo.asm). Each
+// worker owns a SimpleLangCompiler and private streams, so workers never
+// contend on cout/cerr; messages are collected and printed in input order.
+vector<BatchResult> compileBatch(const vector<string>& sources, size_t workerCount, 
+                                 const CompilerOptions& options, bool collectStats, 
+                                 CompilationCache* cache, bool incremental) {
+    vector<BatchResult> results(sources.size());
+    WorkStealingPool pool(workerCount);
+    
+    vector<unique_ptr<SimpleLangCompiler>> compilers;
+    vector<unique_ptr<ostringstream>> messageStreams;
+    DiagnosticOptions quiet;
+    quiet.quiet = true;
+    for (size_t i = 0; i < pool.size(); i++) {
+        compilers.push_back(make_unique<SimpleLangCompiler>());
+        messageStreams.push_back(make_unique<ostringstream>());
+        compilers.back()->setOptions(options);
+        compilers.back()->setDiagnostics(quiet, nullptr, messageStreams.back().get());
+        compilers.back()->setCollectStats(collectStats);
+        compilers.back()->setCache(cache);
+        compilers.back()->setIncremental(incremental);
+    }
+    
+    // Largest files first so the long jobs start early; stealing evens out
+    // the tail.
+    vector<pair<off_t, size_t>> bySize;
+    for (size_t i = 0; i < sources.size(); i++) {
+        struct stat info;
+        bySize.push_back({stat(sources[i].c_str(), &info) == 0 ? info.st_size : 0, i});
+    }
+    sort(bySize.begin(), bySize.end(), greater<pair<off_t, size_t>>());
+    
+    for (size_t rank = 0; rank < bySize.size(); rank++) {
+        size_t index = bySize[rank].second;
+        pool.submit(rank, [&, index](size_t worker) {
+            SimpleLangCompiler& compiler = *compilers[worker];
+            ostringstream& messages = *messageStreams[worker];
+            BatchResult& result = results[index];
+            
+            result.source = sources[index];
+            result.output = batchOutputPath(sources[index]);
+            result.success = compiler.loadSource(result.source) && compiler.compile(result.output);
+            result.stats = compiler.getStats();
+            result.messages = messages.str();
+            messages.str("");
+        });
+    }
+    
+    pool.run();
+    return results;
+}
+
+// =============================================================================
+// COMPILE SERVER
+// =============================================================================
+
+// Wire protocol, over a Unix domain stream socket. Every field is a
+// little-endian u32 byte count followed by that many bytes. A request is
+// two fields: the options (flags as on the command line, separated by
+// whitespace) and the source text. The response is four: a one-byte
+// ServerStatus, the listing, the diagnostics ("line:column: error: message"
+// per line, or "error: message" without a position) and the binary image
+// (empty unless the options include --image). A connection may carry any
+// number of requests, answered in order. A request whose options include
+// --server-stats returns the server's counters as JSON in the listing.
+enum class ServerStatus : uint8_t { OK = 0, COMPILE_FAILED = 1, BAD_REQUEST = 2 };
+
+// Bounds what a client can make the server buffer; responses are trusted.
+const uint32_t SERVER_REQUEST_LIMIT = 256u << 20;
+
+// How long a worker waits on a client that stalls in the middle of a
+// request or stops reading its response. Idle connections wait in the
+// accepting thread's poll set instead and never time out.
+const int SERVER_IO_TIMEOUT_SECONDS = 10;
+
+bool readFully(int fd, void* buffer, size_t size) {
+    char* p = (char*)buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeFully(int fd, string_view data) {
+    while (!data.empty()) {
+        // MSG_NOSIGNAL: a peer that hung up is an error, not a SIGPIPE
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+// Fails on end of stream, I/O errors and fields longer than `limit`.
+bool readField(int fd, string& field, uint32_t limit = UINT32_MAX) {
+    uint8_t length[4];
+    if (!readFully(fd, length, 4)) return false;
+    uint32_t size = length[0] | length[1] << 8 | length[2] << 16 | (uint32_t)length[3] << 24;
+    if (size > limit) return false;
+    field.resize(size);
+    return readFully(fd, field.data(), size);
+}
+
+void appendField(string& message, string_view field) {
+    uint32_t size = field.size();
+    char length[4] = {(char)size, (char)(size >> 8), (char)(size >> 16), (char)(size >> 24)};
+    message.append(length, 4);
+    message.append(field);
+}
+
+// Log-linear histogram of latencies in nanoseconds: exact below 16, then
+// 16 buckets per power of two, so a percentile is off by at most 1/16.
+// Recording is a few instructions and never allocates.
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 4;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+    
+    array<uint64_t, 64 * SUB_BUCKETS> counts{};
+    uint64_t total = 0;
+    uint64_t maximum = 0;
+    
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+    }
+    
+    static uint64_t bucketLimit(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        int shift = bucket / SUB_BUCKETS - 1;
+        return ((bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+    }
+    
+public:
+    void record(uint64_t nanoseconds) {
+        counts[bucketOf(nanoseconds)]++;
+        total++;
+        maximum = max(maximum, nanoseconds);
+    }
+    
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        maximum = max(maximum, other.maximum);
+    }
+    
+    uint64_t count() const { return total; }
+    uint64_t largest() const { return maximum; }
+    
+    // Upper bound of the bucket holding the given fraction of samples.
+    uint64_t percentile(double fraction) const {
+        uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(fraction * total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) return min(bucketLimit(i), maximum);
+        }
+        return maximum;
+    }
+};
+
+// In-memory LRU of encoded responses, shared by the server's workers and
+// bounded by total bytes. Keys are built like CompilationCache keys, with
+// the check hash and source size guarding against collisions.
+class ResponseCache {
+private:
+    struct Entry {
+        CompilationCache::Key key;
+        string response;
+    };
+    
+    list<Entry> entries;   // Most recently used first
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    uint64_t maxBytes;
+    uint64_t currentBytes = 0;
+    uint64_t evictions = 0;
+    mutex lock;
+    
+public:
+    ResponseCache(uint64_t budgetBytes) : maxBytes(budgetBytes) {}
+    
+    bool lookup(const CompilationCache::Key& key, string& response) {
+        lock_guard<mutex> guard(lock);
+        auto found = index.find(key.primary);
+        if (found == index.end()) return false;
+        const Entry& entry = *found->second;
+        if (entry.key.check != key.check || entry.key.sourceBytes != key.sourceBytes) return false;
+        entries.splice(entries.begin(), entries, found->second);
+        response = entry.response;
+        return true;
+    }
+    
+    void store(const CompilationCache::Key& key, string_view response) {
+        if (response.size() > maxBytes) return;
+        lock_guard<mutex> guard(lock);
+        auto found = index.find(key.primary);
+        if (found != index.end()) {
+            currentBytes -= found->second->response.size();
+            entries.erase(found->second);
+            index.erase(found);
+        }
+        entries.push_front({key, string(response)});
+        index[key.primary] = entries.begin();
+        currentBytes += response.size();
+        while (currentBytes > maxBytes) {
+            currentBytes -= entries.back().response.size();
+            index.erase(entries.back().key.primary);
+            entries.pop_back();
+            evictions++;
+        }
+    }
+    
+    void writeJson(ostream& out) {
+        lock_guard<mutex> guard(lock);
+        out << "\"cache_entries\": " << entries.size() << ", \"cache_bytes\": " << currentBytes
+            << ", \"cache_evictions\": " << evictions;
+    }
+};
+
+// Daemon answering compile requests on a Unix domain socket. The accepting
+// thread polls the listener and every idle connection, and queues a
+// connection for a fixed pool of workers once it becomes readable. A
+// worker serves one request and hands the connection back, so clients
+// that hold connections open do not tie up workers. Each worker owns a
+// CompilerContext and its buffers, so after warming up a request costs
+// one compile and no setup. Identical requests are answered from the
+// shared ResponseCache without compiling.
+class CompileServer {
+private:
+    struct Worker {
+        CompilerContext context;
+        CompileResult result;
+        CompilerOptions options;
+        string optionText;
+        string source;
+        string response;
+        string diagnostics;
+        thread runner;
+        
+        mutex lock;   // Guards the counters against a concurrent stats request
+        LatencyHistogram latency;
+        uint64_t requests = 0;
+        uint64_t failures = 0;
+        uint64_t badRequests = 0;
+        uint64_t cacheHits = 0;
+    };
+    
+    string path;
+    ResponseCache cache;
+    vector<unique_ptr<Worker>> workers;
+    chrono::steady_clock::time_point started;
+    
+    mutex queueLock;
+    condition_variable queueReady;
+    deque<int> pending;    // Readable connections waiting for a worker
+    vector<int> returned;  // Served connections to poll again
+    set<int> active;       // Connections being served, shut down on stop
+    bool stopping = false;
+    uint64_t connections = 0;
+    int wakeRead = -1;     // Self-pipe: a byte means `returned` has grown
+    int wakeWrite = -1;
+    
+    static void respond(Worker& worker, ServerStatus status, string_view assembly,
+                        string_view diagnostics, string_view image) {
+        worker.response.clear();
+        char code = (char)status;
+        appendField(worker.response, string_view(&code, 1));
+        appendField(worker.response, assembly);
+        appendField(worker.response, diagnostics);
+        appendField(worker.response, image);
+    }
+    
+    // Leaves the encoded response in worker.response and returns its status.
+    ServerStatus handle(Worker& worker, bool& cacheHit) {
+        istringstream flags(worker.optionText);
+        string flag;
+        worker.options = CompilerOptions();
+        while (flags >> flag) {
+            if (flag == "--server-stats") {
+                ostringstream stats;
+                writeStats(stats);
+                respond(worker, ServerStatus::OK, stats.str(), "", "");
+                return ServerStatus::OK;
+            }
+            bool known = false;
+            string error;
+            try {
+                known = parseCompilerOption(flag, worker.options);
+                if (!known) error = "Unknown option " + flag;
+            } catch (const exception& e) {
+                error = e.what();
+            }
+            if (!error.empty()) {
+                respond(worker, ServerStatus::BAD_REQUEST, "", "error: " + error + "\n", "");
+                return ServerStatus::BAD_REQUEST;
+            }
+        }
+        
+        CompilationCache::Key key = CompilationCache::makeKey(
+            worker.source, listingConfiguration(worker.options) + (worker.options.image ? "I" : "-"));
+        if (cache.lookup(key, worker.response)) {
+            cacheHit = true;
+            return (ServerStatus)worker.response[4];
+        }
+        
+        bool success = worker.context.compile(worker.source, worker.options, worker.result);
+        worker.diagnostics.clear();
+        for (const Diagnostic& diagnostic : worker.result.diagnostics) {
+            if (diagnostic.line > 0) {
+                worker.diagnostics += to_string(diagnostic.line) + ':' + to_string(diagnostic.column) + ": ";
+            }
+            worker.diagnostics += "error: " + diagnostic.message + '\n';
+        }
+        ServerStatus status = success ? ServerStatus::OK : ServerStatus::COMPILE_FAILED;
+        respond(worker, status, worker.result.assembly, worker.diagnostics,
+                string_view((const char*)worker.result.image.data(), worker.result.image.size()));
+        cache.store(key, worker.response);
+        return status;
+    }
+    
+    // Serves one request; false once the connection is finished with.
+    bool serve(Worker& worker, int client) {
+        if (!readField(client, worker.optionText, SERVER_REQUEST_LIMIT) || 
+            !readField(client, worker.source, SERVER_REQUEST_LIMIT)) {
+            return false;
+        }
+        auto start = chrono::steady_clock::now();
+        bool cacheHit = false;
+        ServerStatus status = handle(worker, cacheHit);
+        bool sent = writeFully(client, worker.response);
+        uint64_t elapsed = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count();
+        
+        lock_guard<mutex> guard(worker.lock);
+        worker.latency.record(elapsed);
+        worker.requests++;
+        if (status == ServerStatus::COMPILE_FAILED) worker.failures++;
+        if (status == ServerStatus::BAD_REQUEST) worker.badRequests++;
+        if (cacheHit) worker.cacheHits++;
+        return sent;
+    }
+    
+    void workerLoop(Worker& worker) {
+        unique_lock<mutex> guard(queueLock);
+        while (true) {
+            queueReady.wait(guard, [&] { return stopping || !pending.empty(); });
+            if (stopping) return;
+            int client = pending.front();
+            pending.pop_front();
+            active.insert(client);
+            guard.unlock();
+            
+            bool open = serve(worker, client);
+            // A pipelined request is already buffered: requeue it directly
+            // rather than through a poll round trip
+            char next;
+            bool buffered = open && recv(client, &next, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+            
+            // Closed under the lock so a stopping server never shuts down
+            // a descriptor number that has already been reused
+            guard.lock();
+            active.erase(client);
+            if (!open || stopping) {
+                close(client);
+            } else if (buffered) {
+                pending.push_back(client);
+            } else {
+                returned.push_back(client);
+                char wake = 0;
+                (void)!write(wakeWrite, &wake, 1);   // A full pipe already wakes the poller
+            }
+        }
+    }
+    
+public:
+    CompileServer(const string& socketPath, size_t workerCount, uint64_t cacheBytes)
+        : path(socketPath), cache(cacheBytes) {
+        for (size_t i = 0; i < max<size_t>(workerCount, 1); i++) {
+            workers.push_back(make_unique<Worker>());
+        }
+    }
+    
+    void writeStats(ostream& out) {
+        LatencyHistogram latency;
+        uint64_t requests = 0, failures = 0, badRequests = 0, cacheHits = 0;
+        for (const auto& worker : workers) {
+            lock_guard<mutex> guard(worker->lock);
+            latency.merge(worker->latency);
+            requests += worker->requests;
+            failures += worker->failures;
+            badRequests += worker->badRequests;
+            cacheHits += worker->cacheHits;
+        }
+        uint64_t accepted;
+        {
+            lock_guard<mutex> guard(queueLock);
+            accepted = connections;
+        }
+        
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "{\"uptime_seconds\": %.3f, \"workers\": %zu, \"connections\": %llu, \"requests\": %llu, "
+                 "\"failed\": %llu, \"bad_requests\": %llu, \"cache_hits\": %llu, ",
+                 chrono::duration<double>(chrono::steady_clock::now() - started).count(), workers.size(),
+                 (unsigned long long)accepted, (unsigned long long)requests, (unsigned long long)failures,
+                 (unsigned long long)badRequests, (unsigned long long)cacheHits);
+        out << line;
+        cache.writeJson(out);
+        snprintf(line, sizeof(line),
+                 ", \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+                 latency.percentile(0.5) / 1e3, latency.percentile(0.9) / 1e3, latency.percentile(0.99) / 1e3,
+                 latency.percentile(0.999) / 1e3, latency.largest() / 1e3);
+        out << line;
+    }
+    
+    // Serves until `stop` is set by a SIGINT or SIGTERM handler. Both
+    // signals stay blocked except inside ppoll, so one arriving between
+    // the check of `stop` and the wait still ends the wait. Throws if the
+    // socket cannot be set up.
+    void run(const volatile sig_atomic_t& stop) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw runtime_error("Socket path too long: " + path);
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (listener < 0) throw runtime_error(string("socket: ") + strerror(errno));
+        unlink(path.c_str());
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 128) != 0) {
+            string error = strerror(errno);
+            close(listener);
+            throw runtime_error("Could not listen on " + path + ": " + error);
+        }
+        int wake[2];
+        if (pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+            string error = strerror(errno);
+            close(listener);
+            unlink(path.c_str());
+            throw runtime_error("pipe: " + error);
+        }
+        wakeRead = wake[0];
+        wakeWrite = wake[1];
+        started = chrono::steady_clock::now();
+        
+        // Workers inherit the blocked mask and never see the signals
+        sigset_t signals, previous;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &previous);
+        for (auto& worker : workers) {
+            Worker* w = worker.get();
+            w->runner = thread([this, w] { workerLoop(*w); });
+        }
+        
+        timeval timeout = {SERVER_IO_TIMEOUT_SECONDS, 0};
+        vector<pollfd> polled = {{listener, POLLIN, 0}, {wakeRead, POLLIN, 0}};   // Then idle connections
+        vector<int> ready;
+        while (!stop) {
+            if (ppoll(polled.data(), polled.size(), nullptr, &previous) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            
+            ready.clear();
+            for (size_t i = polled.size(); i-- > 2;) {
+                if (polled[i].revents != 0) {
+                    // Readable, hung up or failed: a worker finds out which
+                    ready.push_back(polled[i].fd);
+                    polled[i] = polled.back();
+                    polled.pop_back();
+                }
+            }
+            if (polled[1].revents != 0) {
+                char drain[64];
+                while (read(wakeRead, drain, sizeof(drain)) > 0) {}
+            }
+            if (polled[0].revents != 0) {
+                int client;
+                while ((client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) >= 0) {
+                    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                    polled.push_back({client, POLLIN, 0});
+                    lock_guard<mutex> guard(queueLock);
+                    connections++;
+                }
+            }
+            
+            lock_guard<mutex> guard(queueLock);
+            for (int client : returned) {
+                polled.push_back({client, POLLIN, 0});
+            }
+            returned.clear();
+            for (int client : ready) {
+                pending.push_back(client);
+                queueReady.notify_one();
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+        
+        close(listener);
+        unlink(path.c_str());
+        {
+            // Wake workers blocked reading from stalled connections
+            lock_guard<mutex> guard(queueLock);
+            stopping = true;
+            for (int client : active) {
+                shutdown(client, SHUT_RDWR);
+            }
+            for (int client : pending) {
+                close(client);
+            }
+            pending.clear();
+            for (int client : returned) {
+                close(client);
+            }
+            returned.clear();
+        }
+        for (size_t i = 2; i < polled.size(); i++) {
+            close(polled[i].fd);
+        }
+        queueReady.notify_all();
+        for (auto& worker : workers) {
+            worker->runner.join();
+        }
+        close(wakeRead);
+        close(wakeWrite);
+    }
+};
+
+volatile sig_atomic_t serverStopRequested = 0;
+
+void requestServerStop(int) {
+    serverStopRequested = 1;
+}
+
+// Installs the SIGINT/SIGTERM handlers (without SA_RESTART, so they
+// interrupt ppoll) and runs the server until one arrives.
+void runCompileServer(CompileServer& server) {
+    struct sigaction action = {};
+    action.sa_handler = requestServerStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    server.run(serverStopRequested);
+}
+
+struct ServerResponse {
+    ServerStatus status = ServerStatus::BAD_REQUEST;
+    string assembly;
+    string diagnostics;
+    string image;
+};
+
+// One persistent connection to a CompileServer.
+class CompileClient {
+private:
+    int fd = -1;
+    string request;
+    string status;
+    
+public:
+    CompileClient(const string& path) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw runtime_error("Socket path too long: " + path);
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+            string error = strerror(errno);
+            if (fd >= 0) close(fd);
+            throw runtime_error("Could not connect to " + path + ": " + error);
+        }
+    }
+    
+    ~CompileClient() {
+        close(fd);
+    }
+    
+    CompileClient(const CompileClient&) = delete;
+    CompileClient& operator=(const CompileClient&) = delete;
+    
+    void compile(string_view options, string_view source, ServerResponse& response) {
+        request.clear();
+        appendField(request, options);
+        appendField(request, source);
+        if (!writeFully(fd, request) || !readField(fd, status) || status.size() != 1 ||
+            !readField(fd, response.assembly) || !readField(fd, response.diagnostics) ||
+            !readField(fd, response.image)) {
+            throw runtime_error("Connection to compile server lost");
+        }
+        response.status = (ServerStatus)status[0];
+    }
+};
+
+// =============================================================================
+// WORKLOAD GENERATOR
+// =============================================================================
+
+struct WorkloadOptions {
+    string shape = "mixed";     // mixed, declarations, expressions, chains, nested, conditions
+    size_t statements = 20000;  // Top-level statements, including the prologue
+    size_t variables = 64;      // Long-lived variables declared up front
+    int depth = 8;              // Parenthesis depth, chain length / 4, if nesting or run length
+    uint64_t seed = 1;
+};
+
+// A splitmix64 stream. The generators draw every choice from it directly
+// (no <random> distributions, whose results differ between standard
+// libraries), so a seed names the same program on every platform.
+struct SplitMix64 {
+    uint64_t state;
+    
+    explicit SplitMix64(uint64_t seed) : state(seed) {}
+    
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    
+    size_t below(size_t bound) {
+        return (size_t)(next() % bound);
+    }
+};
+
+// Produces valid SimpleLang programs of a configurable size and shape from
+// a seeded SplitMix64 stream.
+class WorkloadGenerator {
+private:
+    WorkloadOptions options;
+    SplitMix64 rng;
+    string out;
+    size_t statementCount;
+    size_t temporaryCount;
+    
+    void variable() {
+        out += 'v';
+        out += to_string(rng.below(options.variables));
+    }
+    
+    void operand() {
+        if (rng.below(2)) variable();
+        else out += to_string(rng.below(256));
+    }
+    
+    void binaryOperator() {
+        out += rng.below(2) ? " + " : " - ";
+    }
+    
+    // One side of every operation is a leaf and the other nests deeper, so
+    // a depth-d expression has d + 1 leaves and d levels of parentheses.
+    // Built without recursion so any depth can be generated; leaves that
+    // follow the inner expression are drawn on the way out.
+    void deepExpression(int depth) {
+        vector<bool> leafAfter(depth);
+        for (int level = 0; level < depth; level++) {
+            out += '(';
+            leafAfter[level] = !rng.below(2);
+            if (!leafAfter[level]) {
+                operand();
+                binaryOperator();
+            }
+        }
+        operand();
+        for (int level = depth; level-- > 0; ) {
+            if (leafAfter[level]) {
+                binaryOperator();
+                operand();
+            }
+            out += ')';
+        }
+    }
+    
+    void chain(int terms) {
+        operand();
+        for (int i = 1; i < terms; i++) {
+            binaryOperator();
+            operand();
+        }
+    }
+    
+    void assignment(int expressionDepth, int chainTerms) {
+        variable();
+        out += " = ";
+        if (expressionDepth > 0) deepExpression(expressionDepth);
+        else chain(chainTerms);
+        out += ";\n";
+    }
+    
+    void nestedIf(int depth) {
+        // Indentation is capped so very deep nests stay linear in size
+        auto indent = [&](int level) { out.append(min(level, 16) * 4, ' '); };
+        for (int level = 0; level < depth; level++) {
+            indent(level);
+            out += "if (";
+            chain(2);
+            out += " == ";
+            operand();
+            out += ") {\n";
+        }
+        indent(depth);
+        assignment(0, 3);
+        for (int level = depth; level-- > 0; ) {
+            indent(level);
+            out += "}\n";
+        }
+    }
+    
+    // Adjacent ifs dispatching on one variable, as a switch is written
+    // without one: mostly different constants, some tests repeated and some
+    // conditions without a comparison. Emits `cases` top-level statements.
+    void conditionRun(int cases) {
+        string tested = "v" + to_string(rng.below(options.variables));
+        size_t value = rng.below(256);
+        for (int i = 0; i < cases; i++) {
+            out += "if (";
+            if (rng.below(4) == 0) {
+                variable();
+            } else {
+                if (rng.below(3) != 0) value = rng.below(256);
+                out += tested + " == " + to_string(value);
+            }
+            out += ") {\n    ";
+            assignment(0, 2);
+            out += "}\n";
+        }
+        statementCount += cases - 1;
+    }
+    
+    // A short-lived temporary: declared, assigned, read once. Emits three
+    // top-level statements.
+    void temporary() {
+        string name = "t" + to_string(temporaryCount++);
+        out += "int " + name + ";\n";
+        out += name + " = ";
+        chain(3);
+        out += ";\n";
+        variable();
+        out += " = " + name + " - ";
+        operand();
+        out += ";\n";
+        statementCount += 2;
+    }
+    
+    void statement() {
+        const string& shape = options.shape;
+        int depth = max(options.depth, 1);
+        if (shape == "declarations") {
+            temporary();
+        } else if (shape == "expressions") {
+            assignment(depth, 0);
+        } else if (shape == "chains") {
+            assignment(0, 4 * depth);
+        } else if (shape == "nested") {
+            nestedIf(depth);
+        } else if (shape == "conditions") {
+            conditionRun(depth);
+        } else {
+            switch (rng.below(8)) {
+                case 0: temporary(); break;
+                case 1: assignment(min(depth, 4), 0); break;
+                case 2: assignment(0, 8); break;
+                case 3: nestedIf(min(depth, 2)); break;
+                default: assignment(0, 2); break;
+            }
+        }
+        statementCount++;
+    }
+    
+public:
+    // Patterns naming the long-lived variables, for CompilerOptions::outputs.
+    static vector<string> outputs() {
+        return {"v*"};
+    }
+    
+    static const vector<string>& shapes() {
+        static const vector<string> names = {"mixed", "declarations", "expressions", "chains", "nested", "conditions"};
+        return names;
+    }
+    
+    WorkloadGenerator(const WorkloadOptions& opts) 
+        : options(opts), rng(opts.seed), statementCount(0), temporaryCount(0) {
+        if (find(shapes().begin(), shapes().end(), options.shape) == shapes().end()) {
+            throw runtime_error("Unknown workload shape: " + options.shape);
+        }
+        // Small programs still get a body, not just declarations
+        options.variables = max<size_t>(1, min(options.variables, options.statements / 2));
+    }
+    
+    string generate() {
+        out.clear();
+        statementCount = 0;
+        temporaryCount = 0;
+        out += "// Generated workload: shape " + options.shape + ", seed " + to_string(options.seed) + "\n";
+        for (size_t i = 0; i < options.variables; i++) {
+            out += "int v" + to_string(i) + ";\n";
+            statementCount++;
+        }
+        while (statementCount < options.statements) {
+            statement();
+        }
+        return move(out);
+    }
+};
+
+// =============================================================================
+// BENCHMARKS
+// =============================================================================
+
+struct BenchmarkResult {
+    string workload;
+    string phase;
+    size_t bytes = 0;
+    size_t statements = 0;   // Top-level statements
+    double seconds = 0;      // Best pass
+    int passes = 0;
+};
+
+// Times `body` until it has run at least 3 times and for a quarter of a
+// second, and returns the best pass.
+double bestTime(const function<void()>& body, int& passes) {
+    double best = numeric_limits<double>::max();
+    double elapsed = 0;
+    for (passes = 0; passes < 3 || elapsed < 0.25; passes++) {
+        auto start = chrono::steady_clock::now();
+        body();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = min(best, seconds);
+        elapsed += seconds;
+    }
+    return best;
+}
+
+// Benchmarks each phase on one program: the lexer alone, the parser (which
+// drives the lexer), the code generator on an already parsed AST, and a
+// complete SimpleLangCompiler::compile with `options` writing to /dev/null.
+vector<BenchmarkResult> benchmarkWorkload(const string& name, const string& text, 
+                                          const CompilerOptions& options) {
+    vector<BenchmarkResult> results;
+    auto record = [&](const string& phase, size_t statements, const function<void()>& body) {
+        BenchmarkResult result;
+        result.workload = name;
+        result.phase = phase;
+        result.bytes = text.size();
+        result.statements = statements;
+        result.seconds = bestTime(body, result.passes);
+        results.push_back(result);
+    };
+    
+    SymbolTable symbols;
+    Lexer lexer(text, symbols);
+    Parser parser(lexer);
+    AST ast = parser.parse();
+    if (parser.hasErrors()) {
+        const Diagnostic& first = parser.getDiagnostics().front();
+        throw runtime_error(name + ":" + to_string(first.line) + ":" + to_string(first.column) + 
+                            ": " + first.message);
+    }
+    size_t statements = ast.statements.size();
+    
+    record("lex", statements, [&]() {
+        SymbolTable table;
+        Lexer scanner(text, table);
+        while (scanner.getNextToken().type != TokenType::TOKEN_EOF) {}
+    });
+    record("parse", statements, [&]() {
+        SymbolTable table;
+        Lexer scanner(text, table);
+        Parser reader(scanner);
+        reader.parse();
+    });
+    record("codegen", statements, [&]() {
+        CodeGenerator generator(symbols, options.registerExpressions);
+        generator.generateCode(ast);
+    });
+    
+    SimpleLangCompiler compiler;
+    ostringstream errors;
+    DiagnosticOptions quiet;
+    quiet.quiet = true;
+    compiler.setOptions(options);
+    compiler.setDiagnostics(quiet, nullptr, &errors);
+    compiler.setSource(text);
+    bool compiled = true;
+    record("compile", statements, [&]() {
+        compiled = compiler.compile("/dev/null") && compiled;
+    });
+    if (!compiled) {
+        throw runtime_error(name + ": " + errors.str());
+    }
+    return results;
+}
+
+void writeBenchmarkJson(const vector<BenchmarkResult>& results, ostream& out) {
+    out << "[";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        out << (i ? ",\n " : "") << "{\"workload\":\"" << result.workload << "\""
+            << ",\"phase\":\"" << result.phase << "\""
+            << ",\"bytes\":" << result.bytes
+            << ",\"statements\":" << result.statements
+            << ",\"seconds\":" << result.seconds
+            << ",\"passes\":" << result.passes
+            << ",\"bytes_per_second\":" << result.bytes / result.seconds
+            << ",\"statements_per_second\":" << result.statements / result.seconds << "}";
+    }
+    out << "]" << endl;
+}
+
+void writeBenchmarkText(const vector<BenchmarkResult>& results, ostream& out) {
+    char line[256];
+    snprintf(line, sizeof(line), "%-24s %-8s %10s %10s %14s\n", 
+             "workload", "phase", "best ms", "MB/s", "statements/s");
+    out << line;
+    for (const BenchmarkResult& result : results) {
+        snprintf(line, sizeof(line), "%-24s %-8s %10.3f %10.1f %14.0f\n", 
+                 result.workload.c_str(), result.phase.c_str(), result.seconds * 1e3,
+                 result.bytes / result.seconds / 1e6, result.statements / result.seconds);
+        out << line;
+    }
+}
+
+// =============================================================================
+// DIFFERENTIAL FUZZING
+// =============================================================================
+
+// Reference semantics for SimpleLang, read straight off the AST: 8-bit
+// wraparound arithmetic and variables that start at zero. A declaration
+// creates a new variable that its name refers to from then on, even inside
+// an if that does not run, because names are resolved at compile time. A
+// condition without a comparison tests the result of the last comparison
+// evaluated, as BNE tests the zero flag that only CMP sets.
+class ReferenceEvaluator {
+public:
+    struct Variable {
+        SymbolId symbol;
+        uint8_t value;
+    };
+    
+private:
+    const AST& ast;
+    vector<Variable> variables;   // Every declaration, in program order
+    vector<int> current;          // Per SymbolId: index into variables, -1 if undeclared
+    bool lastEqual = false;
+    
+    int variable(SymbolId symbol) const {
+        if (current[symbol] < 0) throw runtime_error("Reference evaluator: undeclared variable");
+        return current[symbol];
+    }
+    
+    // Recursive on purpose: this is the obviously correct version, and
+    // fuzzed programs are shallow.
+    uint8_t evaluate(NodeId id) {
+        const ASTNode& node = ast[id];
+        switch (node.type) {
+            case ASTNodeType::NUMBER:
+                return (uint8_t)node.value;
+            case ASTNodeType::IDENTIFIER:
+                return variables[variable(node.symbol)].value;
+            case ASTNodeType::BINARY_OPERATION: {
+                uint8_t left = evaluate(node.left);
+                uint8_t right = evaluate(node.right);
+                if (node.op == BinaryOperator::ADD) return (uint8_t)(left + right);
+                if (node.op == BinaryOperator::SUBTRACT) return (uint8_t)(left - right);
+                lastEqual = left == right;
+                return left;
+            }
+            default:
+                throw runtime_error("Reference evaluator: unexpected expression");
+        }
+    }
+    
+public:
+    ReferenceEvaluator(const AST& tree, const SymbolTable& symbols) 
+        : ast(tree), current(symbols.size(), -1) {}
+    
+    const vector<Variable>& run() {
+        for (NodeId id : ast.statements) {
+            bool taken = true;
+            while (ast[id].type == ASTNodeType::IF_STATEMENT) {
+                if (taken) {
+                    evaluate(ast[id].left);
+                    taken = lastEqual;
+                }
+                id = ast[id].right;
+            }
+            
+            const ASTNode& node = ast[id];
+            if (node.type == ASTNodeType::VARIABLE_DECLARATION) {
+                current[node.symbol] = (int)variables.size();
+                variables.push_back({node.symbol, 0});
+            } else if (taken && node.type == ASTNodeType::ASSIGNMENT) {
+                uint8_t value = evaluate(node.left);
+                variables[variable(node.symbol)].value = value;
+            }
+        }
+        return variables;
+    }
+};
+
+// Small random programs aimed at the corners of the language rather than at
+// volume: redeclared names, declarations and assignments inside nested ifs,
+// reads of variables never written, literals wider than 8 bits, conditions
+// without a comparison, conditions repeated from an earlier if, and
+// irregular spacing and comments. Every program is valid.
+class FuzzProgramGenerator {
+private:
+    SplitMix64 rng;
+    string out;
+    vector<string> names;
+    vector<bool> declared;
+    size_t declaredCount = 0;
+    string lastCondition;
+    vector<size_t> ends;
+    
+    void space() {
+        switch (rng.below(12)) {
+            case 0: out += "\n"; break;
+            case 1: out += "  "; break;
+            case 2: out += " // note\n"; break;
+            case 3: out += "\t"; break;
+            default: out += ' '; break;
+        }
+    }
+    
+    void declaredName() {
+        size_t pick = rng.below(declaredCount);
+        for (size_t i = 0; i < names.size(); i++) {
+            if (declared[i] && pick-- == 0) {
+                out += names[i];
+                return;
+            }
+        }
+    }
+    
+    void number() {
+        switch (rng.below(6)) {
+            case 0: out += to_string(rng.below(4)); break;
+            case 1: out += to_string(250 + rng.below(12)); break;
+            case 2: out += to_string(rng.below(100000)); break;
+            default: out += to_string(rng.below(256)); break;
+        }
+    }
+    
+    // A variable or a small number, so equalities hold often enough
+    void smallOperand() {
+        if (rng.below(2)) {
+            declaredName();
+        } else {
+            out += to_string(rng.below(3));
+        }
+        if (rng.below(4) == 0) out += " + 1";
+    }
+    
+    void term(int depth) {
+        if (depth < 3 && rng.below(4) == 0) {
+            out += '(';
+            expression(depth + 1);
+            out += ')';
+        } else if (declaredCount > 0 && rng.below(2)) {
+            declaredName();
+        } else {
+            number();
+        }
+    }
+    
+    void expression(int depth) {
+        term(depth);
+        size_t operations = rng.below(depth == 0 ? 4 : 3);
+        for (size_t i = 0; i < operations; i++) {
+            if (rng.below(3) == 0) space();
+            out += rng.below(2) ? "+" : "-";
+            if (rng.below(3) == 0) space();
+            term(depth);
+        }
+    }
+    
+    void statement() {
+        size_t ifs = rng.below(3) == 0 ? 1 + rng.below(3) : 0;
+        for (size_t i = 0; i < ifs; i++) {
+            out += "if";
+            space();
+            out += '(';
+            if (!lastCondition.empty() && rng.below(3) == 0) {
+                out += lastCondition;
+            } else {
+                size_t start = out.size();
+                expression(0);
+                if (rng.below(8) != 0) {
+                    space();
+                    out += "==";
+                    space();
+                    expression(0);
+                }
+                lastCondition = out.substr(start);
+            }
+            out += ")";
+            space();
+            out += '{';
+            space();
+        }
+        
+        if (declaredCount == 0 || rng.below(6) == 0) {
+            size_t index = rng.below(names.size());
+            out += "int ";
+            out += names[index];
+            if (!declared[index]) {
+                declared[index] = true;
+                declaredCount++;
+            }
+        } else {
+            declaredName();
+            space();
+            out += '=';
+            space();
+            expression(0);
+        }
+        out += ';';
+        
+        for (size_t i = 0; i < ifs; i++) {
+            space();
+            out += '}';
+        }
+        out += '\n';
+    }
+    
+public:
+    FuzzProgramGenerator(uint64_t seed) : rng(seed) {}
+    
+    string generate() {
+        static const char* const pool[] = {"a", "b", "c", "x", "y1", "long_name"};
+        out.clear();
+        names.assign(pool, pool + 1 + rng.below(6));
+        declared.assign(names.size(), false);
+        declaredCount = 0;
+        lastCondition.clear();
+        ends.clear();
+        size_t statements = 1 + rng.below(24);
+        for (size_t i = 0; i < statements; i++) {
+            statement();
+            ends.push_back(out.size());
+        }
+        return move(out);
+    }
+    
+    // Runs of if chains for --fuzz-mode=branches, some nested far past the
+    // branch optimizer's hop and region limits. Conditions come from a
+    // small pool, so adjacent chains repeat compare setups that merge and
+    // branches that thread. Every program is valid.
+    string generateNested() {
+        static const char* const pool[] = {"a", "b", "c"};
+        out.clear();
+        names.assign(pool, pool + 3);
+        declared.assign(names.size(), true);
+        declaredCount = names.size();
+        ends.clear();
+        for (const string& name : names) {
+            out += "int " + name + "; " + name + " = " + to_string(rng.below(3)) + ";\n";
+        }
+        
+        vector<string> conditions(1 + rng.below(4));
+        for (string& condition : conditions) {
+            size_t start = out.size();
+            smallOperand();
+            if (rng.below(6) != 0) {
+                out += " == ";
+                smallOperand();
+            }
+            condition = out.substr(start);
+            out.resize(start);
+        }
+        
+        size_t chains = 1 + rng.below(16);
+        for (size_t i = 0; i < chains; i++) {
+            size_t depth = rng.below(4) == 0 ? rng.below(300) : rng.below(6);
+            for (size_t d = 0; d < depth; d++) {
+                out += "if (";
+                out += conditions[rng.below(conditions.size())];
+                out += rng.below(4) == 0 ? ") {\n" : ") {";
+            }
+            declaredName();
+            out += " = ";
+            smallOperand();
+            out += ';';
+            out.append(depth, '}');
+            out += '\n';
+            ends.push_back(out.size());
+        }
+        return move(out);
+    }
+    
+    // Splits the last generated program into its top-level statements,
+    // each with the comments and whitespace that follow it.
+    vector<string> statements(const string& program) const {
+        vector<string> pieces;
+        size_t start = 0;
+        for (size_t end : ends) {
+            pieces.push_back(program.substr(start, end - start));
+            start = end;
+        }
+        return pieces;
+    }
+    
+    uint64_t random() {
+        return rng.next();
+    }
+};
+
+struct FuzzOptions {
+    uint64_t iterations = 10000;
+    uint64_t seed = 1;
+    string mode = "compile";   // compile, incremental or branches
+};
+
+// Compiles a program and then a chain of edits of it, each time both with
+// --incremental (reusing the state the previous compile saved) and in
+// full, and requires the same outcome and the same listing. Edits delete,
+// duplicate, swap, replace and insert statements, add comments and
+// whitespace, and now and then cut a statement short, so some compiles
+// fail and leave the previous state behind. Constant folding and dead store elimination
+// disable statement reuse, so they are never chosen.
+bool fuzzIncremental(const FuzzOptions& fuzz, ostream& out) {
+    char directory[] = "/tmp/slfuzz.XXXXXX";
+    if (!mkdtemp(directory)) {
+        out << "Error: Could not create a temporary directory: " << strerror(errno) << '\n';
+        return false;
+    }
+    string incrementalPath = string(directory) + "/incremental.asm";
+    string fullPath = string(directory) + "/full.asm";
+    string statePath = incrementalPath + ".slstate";
+    
+    FuzzProgramGenerator generator(fuzz.seed);
+    ostringstream log, errors;
+    SimpleLangCompiler incremental, full;
+    incremental.setIncremental(true);
+    incremental.setDiagnostics(DiagnosticOptions(), &log, &errors);   // Verbose: the log tells about reuse
+    DiagnosticOptions quiet;
+    quiet.quiet = true;
+    full.setDiagnostics(quiet, &log, &errors);
+    
+    uint64_t compiles = 0, reused = 0;
+    bool passed = true;
+    auto start = chrono::steady_clock::now();
+    
+    for (uint64_t iteration = 0; iteration < fuzz.iterations && passed; iteration++) {
+        uint64_t bits = generator.random();
+        CompilerOptions options;
+        options.registerExpressions = bits & 4;
+        options.peephole.pushPop = bits & 8;
+        options.peephole.deadLoads = bits & 16;
+        options.peephole.storeReload = bits & 32;
+        options.comments = bits & 64;
+        options.optimizeBranches = bits & 128;
+        incremental.setOptions(options);
+        full.setOptions(options);
+        unlink(statePath.c_str());
+        
+        string program = generator.generate();
+        vector<string> statements = generator.statements(program);
+        string previous;
+        size_t edits = 1 + generator.random() % 8;
+        for (size_t edit = 0; edit <= edits && passed; edit++) {
+            if (edit > 0) {
+                string donor = generator.generate();
+                vector<string> donors = generator.statements(donor);
+                const string& other = donors[generator.random() % donors.size()];
+                size_t at = generator.random() % statements.size();
+                string& statement = statements[at];
+                switch (generator.random() % 8) {
+                    case 0: if (statements.size() > 1) statements.erase(statements.begin() + at); break;
+                    case 1: statements.insert(statements.begin() + at, statement); break;
+                    case 2: if (at + 1 < statements.size()) swap(statement, statements[at + 1]); break;
+                    case 3: statement = other; break;
+                    case 4: statements.insert(statements.begin() + at, other); break;
+                    case 5: statements.push_back(other); break;
+                    case 6: statement.insert(0, generator.random() & 1 ? "// edited\n" : "  "); break;
+                    default:
+                        // Drops the ';' or '}' before the newline
+                        if (generator.random() % 4 == 0) statement.erase(statement.size() - 2, 1);
+                        break;
+                }
+                previous.swap(program);
+                program.clear();
+                for (const string& piece : statements) program += piece;
+            }
+            
+            log.str("");
+            incremental.setSource(program);
+            full.setSource(program);
+            bool incrementalSuccess = incremental.compile(incrementalPath);
+            bool fullSuccess = full.compile(fullPath);
+            compiles++;
+            if (log.str().find("Reused ") != string::npos) reused++;
+            
+            string failure;
+            SourceBuffer incrementalListing, fullListing;
+            if (incrementalSuccess != fullSuccess) {
+                failure = incrementalSuccess ? "only the incremental compile succeeded" 
+                                             : "only the full compile succeeded";
+            } else if (fullSuccess && (!incrementalListing.loadFile(incrementalPath) || 
+                                       !fullListing.loadFile(fullPath) || 
+                                       incrementalListing.text() != fullListing.text())) {
+                failure = "the incremental listing differs from the full one";
+            }
+            if (!failure.empty()) {
+                out << "Mismatch in program " << iteration << ", edit " << edit << " (seed " << fuzz.seed 
+                    << "): " << failure << '\n';
+                out << "Options: register-expressions=" << options.registerExpressions 
+                    << " optimize-branches=" << options.optimizeBranches 
+                    << " push-pop=" << options.peephole.pushPop 
+                    << " dead-loads=" << options.peephole.deadLoads 
+                    << " store-reload=" << options.peephole.storeReload 
+                    << " comments=" << options.comments << '\n';
+                if (edit > 0) out << "--- previous ---\n" << previous;
+                out << "--- program ---\n" << program << "---------------\n";
+                passed = false;
+            }
+        }
+    }
+    
+    unlink(statePath.c_str());
+    unlink(incrementalPath.c_str());
+    unlink(fullPath.c_str());
+    rmdir(directory);
+    if (!passed) return false;
+    
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char line[160];
+    snprintf(line, sizeof(line), "Fuzzed %llu programs in %.2f s (%llu compiles, %llu of them reusing "
+             "statements), no mismatches\n", (unsigned long long)fuzz.iterations, seconds, 
+             (unsigned long long)compiles, (unsigned long long)reused);
+    out << line;
+    return true;
+}
+
+// Evaluates a program with the ReferenceEvaluator, compiles it with
+// `options` and runs the result on the Simulator (and its binary image,
+// when the code fits), then compares the final values of the output
+// variables. With `pickOutputs`, a random subset of the names becomes the
+// outputs. Returns the mismatch, or an empty string.
+string checkProgram(const string& program, CompilerOptions& options, bool pickOutputs,
+                    FuzzProgramGenerator& generator, CompilerContext& context, CompileResult& result,
+                    uint64_t& instructions) {
+    string failure;
+    vector<ReferenceEvaluator::Variable> expected;
+    try {
+        SymbolTable referenceSymbols;
+        Lexer lexer(program, referenceSymbols);
+        Parser parser(lexer);
+        AST ast = parser.parse();
+        expected = ReferenceEvaluator(ast, referenceSymbols).run();
+        
+        // Outputs: every variable, or a random subset of the names
+        if (pickOutputs) {
+            for (SymbolId id = 0; id < referenceSymbols.size(); id++) {
+                if (generator.random() & 1) options.outputs.push_back(referenceSymbols.name(id));
+            }
+            if (options.outputs.empty()) options.outputs.push_back(referenceSymbols.name(0));
+        }
+        
+        if (!context.compile(program, options, result)) {
+            throw runtime_error(result.diagnostics.front().message);
+        }
+        const vector<Instruction>& code = context.instructions();
+        const SymbolTable& symbols = context.symbolTable();
+        vector<vector<Instruction>> runs = {code};
+        if (codeBytes(code) <= CODE_LIMIT) {
+            array<uint8_t, IMAGE_SIZE> image = encodeImage(code);
+            runs.push_back(decodeImage(image.data(), image.size()));
+        }
+        
+        // The n-th declaration of a name in the code is its n-th in the program
+        vector<uint8_t> addresses;
+        vector<SymbolId> declarations;
+        for (const Instruction& inst : code) {
+            if (inst.op != Opcode::DECLARE) continue;
+            declarations.push_back(inst.symbol);
+            addresses.push_back((uint8_t)inst.operand);
+        }
+        vector<ReferenceEvaluator::Variable> reference;
+        for (const auto& variable : expected) {
+            if (isOutputVariable(options.outputs, referenceSymbols.name(variable.symbol))) {
+                reference.push_back(variable);
+            }
+        }
+        
+        for (size_t r = 0; r < runs.size() && failure.empty(); r++) {
+            Simulator simulator;
+            simulator.load(runs[r], symbols);
+            Simulator::State state = simulator.run();
+            instructions += state.steps;
+            
+            size_t next = 0;
+            for (size_t d = 0; d < declarations.size() && failure.empty(); d++) {
+                const string& name = symbols.name(declarations[d]);
+                if (!isOutputVariable(options.outputs, name)) continue;
+                if (next == reference.size() || referenceSymbols.name(reference[next].symbol) != name) {
+                    failure = "declaration of " + name + " does not match the program";
+                } else if (state.memory[addresses[d]] != reference[next].value) {
+                    failure = name + " = " + to_string(state.memory[addresses[d]]) + 
+                              (r ? " (binary image)" : "") + ", expected " + 
+                              to_string(reference[next].value);
+                }
+                next++;
+            }
+            if (failure.empty() && next != reference.size()) {
+                failure = "missing declarations in the generated code";
+            }
+        }
+    } catch (const exception& e) {
+        failure = e.what();
+    }
+    return failure;
+}
+
+void reportMismatch(ostream& out, uint64_t iteration, const FuzzOptions& fuzz, const string& failure,
+                    const CompilerOptions& options, const string& program) {
+    out << "Mismatch in program " << iteration << " (seed " << fuzz.seed << "): " << failure << '\n';
+    out << "Options: fold-constants=" << options.foldConstants 
+        << " eliminate-dead-stores=" << options.eliminateDeadStores 
+        << " register-expressions=" << options.registerExpressions 
+        << " optimize-branches=" << options.optimizeBranches 
+        << " push-pop=" << options.peephole.pushPop 
+        << " dead-loads=" << options.peephole.deadLoads 
+        << " store-reload=" << options.peephole.storeReload;
+    if (!options.outputs.empty()) {
+        out << " outputs=";
+        for (size_t i = 0; i < options.outputs.size(); i++) {
+            out << (i ? "," : "") << options.outputs[i];
+        }
+    }
+    out << "\n--- program ---\n" << program << "---------------\n";
+}
+
+// Checks deeply nested if chains from generateNested, compiled once
+// without optimization and once with the branch optimizer plus a random
+// choice of the other optimizations; both must match the reference.
+bool fuzzBranches(const FuzzOptions& fuzz, ostream& out) {
+    FuzzProgramGenerator generator(fuzz.seed);
+    CompilerContext context;
+    CompileResult result;
+    uint64_t instructions = 0, removed = 0;
+    auto start = chrono::steady_clock::now();
+    
+    for (uint64_t iteration = 0; iteration < fuzz.iterations; iteration++) {
+        string program = generator.generateNested();
+        uint64_t bits = generator.random();
+        CompilerOptions optimized;
+        optimized.foldConstants = bits & 1;
+        optimized.eliminateDeadStores = bits & 2;
+        optimized.registerExpressions = bits & 4;
+        optimized.peephole.pushPop = bits & 8;
+        optimized.peephole.deadLoads = bits & 16;
+        optimized.peephole.storeReload = bits & 32;
+        optimized.optimizeBranches = true;
+        
+        for (CompilerOptions options : {CompilerOptions(), optimized}) {
+            string failure = checkProgram(program, options, false, generator, context, result, instructions);
+            if (!failure.empty()) {
+                reportMismatch(out, iteration, fuzz, failure, options, program);
+                return false;
+            }
+            if (options.optimizeBranches) {
+                removed += result.stats.instructionsGenerated - result.stats.instructionsEmitted;
+            }
+        }
+    }
+    
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char line[160];
+    snprintf(line, sizeof(line), "Fuzzed %llu programs in %.2f s (%llu instructions simulated, %llu "
+             "removed by optimization), no mismatches\n", (unsigned long long)fuzz.iterations, seconds, 
+             (unsigned long long)instructions, (unsigned long long)removed);
+    out << line;
+    return true;
+}
+
+// Generates programs, evaluates each with the ReferenceEvaluator, compiles
+// it under randomly chosen optimization options and runs the result on the
+// Simulator (and its binary image, when the code fits), then compares the
+// final values of the output variables. Stops at the first mismatch, which
+// is printed with the program; returns whether none was found.
+bool runFuzzer(const FuzzOptions& fuzz, ostream& out) {
+    if (fuzz.mode == "incremental") return fuzzIncremental(fuzz, out);
+    if (fuzz.mode == "branches") return fuzzBranches(fuzz, out);
+    
+    FuzzProgramGenerator generator(fuzz.seed);
+    CompilerContext context;
+    CompileResult result;
+    uint64_t instructions = 0;
+    auto start = chrono::steady_clock::now();
+    
+    for (uint64_t iteration = 0; iteration < fuzz.iterations; iteration++) {
+        string program = generator.generate();
+        uint64_t bits = generator.random();
+        CompilerOptions options;
+        options.foldConstants = bits & 1;
+        options.eliminateDeadStores = bits & 2;
+        options.registerExpressions = bits & 4;
+        options.peephole.pushPop = bits & 8;
+        options.peephole.deadLoads = bits & 16;
+        options.peephole.storeReload = bits & 32;
+        options.optimizeBranches = bits & 128;
+        
+        string failure = checkProgram(program, options, bits & 64, generator, context, result, instructions);
+        if (!failure.empty()) {
+            reportMismatch(out, iteration, fuzz, failure, options, program);
+            return false;
+        }
+    }
+    
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char line[160];
+    snprintf(line, sizeof(line), "Fuzzed %llu programs in %.2f s (%.0f programs/s, %llu instructions "
+             "simulated), no mismatches\n", (unsigned long long)fuzz.iterations, seconds, 
+             fuzz.iterations / max(seconds, 1e-9), (unsigned long long)instructions);
+    out << line;
+    return true;
+}
+
+// =============================================================================
+// MAIN FUNCTION
+// =============================================================================
+
+int main(int argc, char* argv[]) {
+    SimpleLangCompiler compiler;
+    CompilerOptions options;
+    DiagnosticOptions diagnostics;
+    vector<string> positional;
+    string simulateFile;
+    string statsFormat;
+    string statsFile;   // Where the statistics go instead of stdout
+    string cacheDirectory;
+    uint64_t cacheMegabytes = 64;
+    bool incremental = false;
+    long jobs = -1;   // -1: single-file mode, 0: one worker per hardware thread
+    bool runAfterCompile = false;
+    string benchFormat;
+    string generateShape;
+    WorkloadOptions workload;
+    bool fuzz = false;
+    FuzzOptions fuzzOptions;
+    string serveSocket;
+    string connectSocket;
+    string requestOptions;   // The compiler option flags, forwarded by --connect
+    bool serverStats = false;
+    
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool compilerOption;
+        try {
+            compilerOption = parseCompilerOption(arg, options);
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+        if (compilerOption) {
+            requestOptions += (requestOptions.empty() ? "" : " ") + arg;
+        } else if (arg == "--stats=json" || arg == "--stats=text" || arg == "--stats") {
+            statsFormat = arg == "--stats=json" ? "json" : "text";
+            compiler.setCollectStats(true);
+        } else if (arg.compare(0, 13, "--stats-file=") == 0) {
+            statsFile = arg.substr(13);
+            compiler.setCollectStats(true);
+        } else if (arg == "-q" || arg == "--quiet") {
+            diagnostics.quiet = true;
+        } else if (arg == "--trace-tokens") {
+            diagnostics.traceTokens = true;
+        } else if (arg == "--dump-ast") {
+            diagnostics.dumpAst = true;
+        } else if (arg == "--run") {
+            runAfterCompile = true;
+            compiler.setRunAfterCompile(true);
+        } else if (arg == "--simulate" && i + 1 < argc) {
+            simulateFile = argv[++i];
+        } else if (arg == "--bench" || arg == "--bench=json" || arg == "--bench=text") {
+            benchFormat = arg == "--bench=json" ? "json" : "text";
+        } else if (arg.compare(0, 11, "--generate=") == 0) {
+            generateShape = arg.substr(11);
+            workload.shape = generateShape;
+        } else if (arg.compare(0, 13, "--statements=") == 0) {
+            workload.statements = strtoull(arg.c_str() + 13, nullptr, 10);
+        } else if (arg.compare(0, 7, "--seed=") == 0) {
+            workload.seed = fuzzOptions.seed = strtoull(arg.c_str() + 7, nullptr, 10);
+        } else if (arg == "--fuzz" || arg.compare(0, 7, "--fuzz=") == 0) {
+            fuzz = true;
+            if (arg.size() > 7) fuzzOptions.iterations = strtoull(arg.c_str() + 7, nullptr, 10);
+        } else if (arg.compare(0, 12, "--fuzz-mode=") == 0) {
+            fuzzOptions.mode = arg.substr(12);
+            if (fuzzOptions.mode != "compile" && fuzzOptions.mode != "incremental" && 
+                fuzzOptions.mode != "branches") {
+                cerr << "Error: --fuzz-mode expects compile, incremental or branches" << endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 8, "--depth=") == 0) {
+            workload.depth = atoi(arg.c_str() + 8);
+        } else if (arg.compare(0, 8, "--serve=") == 0) {
+            serveSocket = arg.substr(8);
+        } else if (arg.compare(0, 10, "--connect=") == 0) {
+            connectSocket = arg.substr(10);
+        } else if (arg == "--server-stats") {
+            serverStats = true;
+        } else if (arg == "--incremental") {
+            incremental = true;
+            compiler.setIncremental(true);
+        } else if (arg == "--cache" || arg.compare(0, 8, "--cache=") == 0) {
+            cacheDirectory = arg.size() > 8 ? arg.substr(8) : ".slcache";
+        } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+            cacheMegabytes = strtoull(arg.c_str() + 13, nullptr, 10);
+            if (cacheMegabytes == 0) {
+                cerr << "Error: --cache-size expects a size in megabytes" << endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 2, "-j") == 0) {
+            string count = arg.size() > 2 ? arg.substr(2) : (i + 1 < argc ? argv[++i] : "");
+            char* end = nullptr;
+            jobs = strtol(count.c_str(), &end, 10);
+            if (count.empty() || *end != '\0' || jobs < 0) {
+                cerr << "Error: -j expects a non-negative worker count" << endl;
+                return 1;
+            }
+        } else if (arg == "--simulate") {
+            cerr << "Error: --simulate expects an assembly file or image" << endl;
+            return 1;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            // A mistyped flag must not be taken for a source path (or be
+            // forwarded by --connect)
+            cerr << "Error: Unknown option " << arg << endl;
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (!statsFile.empty() && statsFormat.empty()) statsFormat = "json";
+    // JSON on stdout must be the only thing there for a script to parse it
+    if (statsFormat == "json" && statsFile.empty()) diagnostics.quiet = true;
+    
+    // Writes the statistics to --stats-file, or to stdout after the log
+    auto reportStats = [&](const CompileStats& stats) {
+        ostringstream report;
+        if (statsFormat == "json") {
+            stats.writeJson(report);
+        } else {
+            if (statsFile.empty()) report << "\n=== STATISTICS ===\n";
+            stats.writeText(report);
+        }
+        if (statsFile.empty()) {
+            cout << report.str() << flush;
+        } else if (!writeFile(statsFile, report.str())) {
+            cerr << "Error: Could not write statistics to " << statsFile << endl;
+            return false;
+        }
+        return true;
+    };
+    
+    if (fuzz) {
+        return runFuzzer(fuzzOptions, cout) ? 0 : 1;
+    }
+    
+    if (!serveSocket.empty()) {
+        // Compile daemon; per-request options come from the clients
+        size_t workers = jobs > 0 ? (size_t)jobs : max(1u, thread::hardware_concurrency());
+        CompileServer server(serveSocket, workers, cacheMegabytes << 20);
+        if (!diagnostics.quiet) {
+            cout << "Serving on " << serveSocket << " with " << workers << " workers" << endl;
+        }
+        try {
+            runCompileServer(server);
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+        server.writeStats(cout);
+        return 0;
+    }
+    
+    if (!connectSocket.empty()) {
+        // Compile each source on a running server (a.sl -> a.asm), over
+        // one connection
+        try {
+            CompileClient client(connectSocket);
+            ServerResponse response;
+            if (serverStats) {
+                client.compile("--server-stats", "", response);
+                cout << response.assembly;
+                return 0;
+            }
+            if (positional.empty()) {
+                cerr << "Error: No source files given for the compile server" << endl;
+                return 1;
+            }
+            size_t failures = 0;
+            for (const string& source : positional) {
+                SourceBuffer file;
+                if (!file.loadFile(source)) {
+                    cerr << "Error: Could not open source file " << source << endl;
+                    failures++;
+                    continue;
+                }
+                client.compile(requestOptions, file.text(), response);
+                
+                istringstream messages(response.diagnostics);
+                string message;
+                while (getline(messages, message)) {
+                    cerr << source << ':' << (message.compare(0, 6, "error:") == 0 ? " " : "") << message << '\n';
+                }
+                string output = batchOutputPath(source);
+                if (response.status != ServerStatus::OK) {
+                    failures++;
+                } else if (!writeFile(output, response.assembly) || 
+                           (!response.image.empty() && !writeFile(imagePath(output), response.image))) {
+                    cerr << "Error: Could not write " << output << endl;
+                    failures++;
+                } else if (!diagnostics.quiet) {
+                    cout << source << " -> " << output << "\n";
+                }
+            }
+            return failures == 0 ? 0 : 1;
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+    }
+    
+    if (!benchFormat.empty()) {
+        // Benchmark the given files, or generated workloads of every shape
+        // (just one with --generate=SHAPE)
+        vector<pair<string, string>> programs;
+        try {
+            for (const string& filename : positional) {
+                SourceBuffer file;
+                if (!file.loadFile(filename)) {
+                    cerr << "Error: Could not open source file " << filename << endl;
+                    return 1;
+                }
+                programs.push_back({filename, string(file.text())});
+            }
+            if (programs.empty()) {
+                vector<string> shapes = generateShape.empty() ? WorkloadGenerator::shapes() 
+                                                              : vector<string>{generateShape};
+                for (const string& shape : shapes) {
+                    workload.shape = shape;
+                    programs.push_back({shape, WorkloadGenerator(workload).generate()});
+                }
+                // Only the long-lived variables are results; the temporaries
+                // would not fit in memory without sharing it
+                if (options.outputs.empty()) options.outputs = WorkloadGenerator::outputs();
+            }
+            
+            vector<BenchmarkResult> results;
+            for (const auto& program : programs) {
+                vector<BenchmarkResult> phases = benchmarkWorkload(program.first, program.second, options);
+                results.insert(results.end(), phases.begin(), phases.end());
+            }
+            if (benchFormat == "json") writeBenchmarkJson(results, cout);
+            else writeBenchmarkText(results, cout);
+        } catch (const exception& e) {
+            cerr << "Benchmark error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (!generateShape.empty()) {
+        // Write a generated program to the output file, or stdout
+        try {
+            string program = WorkloadGenerator(workload).generate();
+            if (positional.empty()) {
+                cout << program;
+            } else if (!writeFile(positional[0], program)) {
+                cerr << "Error: Could not open file " << positional[0] << " for writing" << endl;
+                return 1;
+            }
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (!diagnostics.quiet) {
+        cout << "SimpleLang Compiler for 8-bit CPU\n";
+        cout << "=================================\n";
+    }
+    
+    if (!simulateFile.empty()) {
+        // Run an existing assembly file or binary image on the built-in simulator
+        ifstream file(simulateFile, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open assembly file " << simulateFile << endl;
+            return 1;
+        }
+        bool isImage = simulateFile.size() > 4 && simulateFile.compare(simulateFile.size() - 4, 4, ".bin") == 0;
+        string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        try {
+            SymbolTable symbols;
+            vector<Instruction> code;
+            if (isImage) {
+                code = decodeImage((const uint8_t*)contents.data(), contents.size());
+            } else {
+                vector<string> lines;
+                string line;
+                istringstream text(contents);
+                while (getline(text, line)) {
+                    lines.push_back(line);
+                }
+                code = readAssembly(lines, symbols);
+            }
+            DiagnosticSink results(&cout);
+            DiagnosticSink errors(&cerr);
+            return simulateProgram(code, symbols, results, errors, options.outputs) ? 0 : 1;
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+    }
+    
+    unique_ptr<CompilationCache> cache;
+    if (!cacheDirectory.empty()) {
+        cache = make_unique<CompilationCache>(cacheDirectory, cacheMegabytes << 20);
+        compiler.setCache(cache.get());
+    }
+    
+    if (jobs >= 0) {
+        // Batch mode: every positional argument is a source file, or
+        // @manifest naming a file with one source path per line
+        if (runAfterCompile) {
+            cerr << "Error: --run cannot be combined with -j" << endl;
+            return 1;
+        }
+        vector<string> sources;
+        for (const string& arg : positional) {
+            if (arg[0] != '@') {
+                sources.push_back(arg);
+                continue;
+            }
+            ifstream manifest(arg.substr(1));
+            if (!manifest.is_open()) {
+                cerr << "Error: Could not open manifest " << arg.substr(1) << endl;
+                return 1;
+            }
+            string path;
+            while (getline(manifest, path)) {
+                if (!path.empty()) sources.push_back(path);
+            }
+        }
+        if (sources.empty()) {
+            cerr << "Error: No source files given for batch compilation" << endl;
+            return 1;
+        }
+        
+        size_t workers = jobs > 0 ? (size_t)jobs : max(1u, thread::hardware_concurrency());
+        workers = min(workers, sources.size());
+        
+        auto start = chrono::steady_clock::now();
+        vector<BatchResult> results = compileBatch(sources, workers, options, !statsFormat.empty(), 
+                                                   cache.get(), incremental);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        CompileStats total;
+        size_t failures = 0;
+        for (const BatchResult& result : results) {
+            cerr << result.messages;
+            if (!result.success) {
+                failures++;
+                cerr << "FAILED " << result.source << endl;
+            } else if (!diagnostics.quiet) {
+                cout << result.source << " -> " << result.output << "\n";
+            }
+            total.accumulate(result.stats);
+        }
+        
+        if (!diagnostics.quiet) {
+            char summary[256];
+            snprintf(summary, sizeof(summary), 
+                     "\n%zu files (%zu failed) on %zu workers in %.3f s: %.1f files/s, %.2f MB/s, %.0f statements/s\n",
+                     results.size(), failures, workers, seconds, results.size() / seconds,
+                     total.sourceBytes / seconds / 1e6, total.statements / seconds);
+            cout << summary;
+            if (cache) {
+                cout << "Cache: " << total.cacheHits << " hits, " << total.cacheMisses 
+                     << " misses, " << total.cacheEvictions << " evictions\n";
+            }
+        }
+        if (!statsFormat.empty() && !reportStats(total)) return 1;
+        return failures == 0 ? 0 : 1;
+    }
+    
+    compiler.setOptions(options);
+    compiler.setDiagnostics(diagnostics);
     
-    if (argc > 1) {
+    bool success = false;
+    if (!positional.empty()) {
         // Compile from file
-        string filename = argv[1];
+        string filename = positional[0];
         if (compiler.loadSource(filename)) {
-            string outputFile = (argc > 2) ? argv[2] : "output.asm";
-            compiler.compile(outputFile);
+            string outputFile = (positional.size() > 1) ? positional[1] : "output.asm";
+            success = compiler.compile(outputFile);
         }
     } else {
         // Compile example program
-        cout << "\nCompiling example program..." << endl;
+        if (!diagnostics.quiet) cout << "\nCompiling example program...\n";
         
         string exampleCode = R"(
 // Variable declarations
@@ -656,8 +6276,9 @@ if (c == 30) {
 )";
         
         compiler.setSource(exampleCode);
-        compiler.compile();
+        success = compiler.compile();
     }
     
-    return 0;
+    if (!statsFormat.empty() && !reportStats(compiler.getStats())) return 1;
+    return success ? 0 : 1;
 }